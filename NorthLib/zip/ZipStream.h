@@ -10,15 +10,31 @@
 
 @interface ZipStream : NSObject 
 
-/// current position in zip stream
-@property (nonatomic,assign) long bytesProcessed;
+/// current position in zip stream (updated by the scanning thread of
+/// 'scanDataAsync')
+@property (atomic,assign) long bytesProcessed;
 
 /// total number of bytes given to 'scanData'
 @property (nonatomic,assign) long bytesReceived;
 
+/// offset in zip archive after the last file passed to 'onFile' (may be
+/// read while 'scanDataAsync' is active)
+@property (nonatomic,readonly) long resumeOffset;
+
+/// the data passed to 'scanData' starts at 'offset' of the zip archive
+/// (eg. 'resumeOffset' of an interrupted ZipStream), call before 'scanData'
+- (void) resumeAt: (long) offset;
+
 /// scans the given data for enclosed zipped files
 - (void) scanData: (NSData *) data;
 
+/// like 'scanData' but the data is queued and scanned by a separate
+/// thread calling 'onFile' (don't mix with 'scanData')
+- (void) scanDataAsync: (NSData *) data;
+
+/// waits until all data passed to 'scanDataAsync' has been scanned
+- (void) finish;
+
 /// closure to call when file encountered in zip stream
 - (void) onFile: (void (^)(NSString *name, NSData *data1)) closure;
 
@@ -19,6 +19,7 @@ class ZipDelegate;
 {
   zip::Stream *_zipStream;
   ZipDelegate *_zipStreamDelegate;
+  BOOL _receiving;
 }
 
 // Getters and setters
@@ -33,6 +34,7 @@ class ZipDelegate;
 - (zip::Stream *) zipStream {
   if ( !_zipStream ) {
     _zipStream = new zip::Stream( *(self.zipStreamDelegate) );
+    _zipStream -> setZeroCopy( true );
     _bytesReceived = 0;
     _bytesProcessed = 0;
   }
@@ -40,10 +42,28 @@ class ZipDelegate;
 }
 
 - (void) scanData: (NSData *) data {
-  self.zipStream -> scan( (const char *) data.bytes, (int) data.length );
+  self.zipStream -> scan( (const char *) data.bytes, (long) data.length );
   _bytesReceived += data.length;
 }
 
+- (void) scanDataAsync: (NSData *) data {
+  if ( !_receiving ) { self.zipStream -> setReceiving( 16 ); _receiving = YES; }
+  self.zipStream -> receive( (const char *) data.bytes, (long) data.length );
+  _bytesReceived += data.length;
+}
+
+- (void) finish {
+  self.zipStream -> finish();
+}
+
+- (long) resumeOffset {
+  return self.zipStream -> resumeOffset();
+}
+
+- (void) resumeAt: (long) offset {
+  self.zipStream -> setOffset( offset );
+}
+
 - (void) onFile:(void (^)(NSString *, NSData *))closure {
   self.onFileClosure = closure;
 }
@@ -61,13 +81,21 @@ public:
   void handleFile( zip::File *file );
 };
 
+// The file's contents are passed without copying unless they refer to the
+// data passed to scanData:
 void ZipDelegate::handleFile( zip::File *file ) {
-  NSData *data = [NSData dataWithBytes:file->data() length:file->size()];
+  NSData *data;
   NSString *fname = [NSString stringWithUTF8String:file->name()];
+  if ( file->isView() || !file->data() ) {
+    data = [NSData dataWithBytes:file->data() length:file->size()];
+    delete file;
+  }
+  else data = [[NSData alloc] initWithBytesNoCopy:file->data() 
+                length:file->size() deallocator:^(void *bytes, NSUInteger len) 
+                { delete file; }];
   _stream.bytesProcessed = _stream -> _zipStream -> bytesRead();
   if ( _stream -> _onFileClosure ) 
     _stream -> _onFileClosure( fname, data );
-  delete file;
 }
 
 
@@ -1,5 +1,67 @@
-#include <zlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+#include <vector>
+#include <deque>
+#include <map>
+#include <string>
+#include <functional>
+#include <exception>
 #include "zip.hh"
+#include "fileop.h"
+
+// inflate backend: zlib (default) or zlib-ng (native API, see Inflater)
+#if defined(ZIP_ZLIB_NG)
+#  include <zlib-ng.h>
+#  define ZLIB(f) zng_##f
+   typedef zng_stream ZStream;
+#else
+#  define ZLIB_CONST
+#  include <zlib.h>
+#  define ZLIB(f) f
+   typedef z_stream ZStream;
+#endif
+
+// asynchronous reads using io_uring (see UringReadahead)
+#if defined(ZIP_URING)
+#  include <sys/syscall.h>
+#  include <linux/io_uring.h>
+#endif
+
+// whole buffer inflate (see inflateWhole)
+#if defined(ZIP_LIBDEFLATE)
+#  include <libdeflate.h>
+#endif
+
+// optional decoders (see Decoders)
+#if defined(ZIP_ZSTD)
+#  include <zstd.h>
+#endif
+#if defined(ZIP_LZMA)
+#  include <lzma.h>
+#endif
+
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#  include <arm_neon.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#  include <wmmintrin.h>
+#  define ZIP_CRC_PCLMUL
+#elif defined(__ARM_FEATURE_CRC32)
+#  include <arm_acle.h>
+#endif
 
 #undef DEBUG
 
@@ -29,11 +91,49 @@ namespace zip {
 typedef unsigned char tByte;
 typedef struct { tByte low, high; } tByte2;
 typedef struct { tByte2 low, high; } tByte4;
+typedef struct { tByte4 low, high; } tByte8;
 
 unsigned bytes2number( tByte2 val ) 
   { return val.low | (val.high << 8); }
 unsigned bytes2number( tByte4 val )
   { return bytes2number(val.low) | (bytes2number(val.high) << 16); }
+uint64_t bytes2number( tByte8 val )
+  { return bytes2number(val.low) | ((uint64_t) bytes2number(val.high) << 32); }
+
+void number2bytes( tByte2 &val, unsigned n ) 
+  { val.low = n & 0xff; val.high = (n >> 8) & 0xff; }
+void number2bytes( tByte4 &val, unsigned n ) {
+  val.low.low = n & 0xff; val.low.high = (n >> 8) & 0xff;
+  val.high.low = (n >> 16) & 0xff; val.high.high = (n >> 24) & 0xff;
+}
+void number2bytes( tByte8 &val, uint64_t n ) 
+  { number2bytes( val.low, (unsigned) n ); 
+    number2bytes( val.high, (unsigned)(n >> 32) ); }
+
+// 32 bit size or offset replaced by a value in the Zip64 extra field
+static const unsigned Zip64Mark = 0xffffffff;
+
+// id of the Zip64 extended information extra field
+static const unsigned Zip64Extra = 0x0001;
+
+/**
+ *  findExtra returns the data of the extra field 'id' in the extra fields
+ *  'extra' ('len' bytes) and stores its length in *flen. 0 is returned if 
+ *  there is no such field.
+ */
+
+static const tByte *findExtra( const tByte *extra, unsigned len, 
+                               unsigned id, unsigned *flen ) {
+  while ( len >= 4 ) {
+    unsigned fid = extra[0] | (extra[1] << 8), 
+             l = extra[2] | (extra[3] << 8);
+    if ( l > len - 4 ) break;
+    if ( fid == id ) { *flen = l; return extra + 4; }
+    extra += 4 + l;
+    len -= 4 + l;
+  }
+  return 0;
+}
 
 
 /**
@@ -43,6 +143,7 @@ unsigned bytes2number( tByte4 val )
 class DataDescriptor {
 
   friend class Header;
+  friend class WriterState;
   private:
   tByte4 _signature;	// 0x08074b50 
   tByte4 _crc32;	// CRC-32 checksum
@@ -59,6 +160,178 @@ class DataDescriptor {
 };  // class DataDescriptor
 
 
+/**
+ *  Zip64DataDescriptor is the DataDescriptor of a file whose header has a 
+ *  Zip64 extra field (with 64 bit sizes)
+ */
+
+class Zip64DataDescriptor {
+
+  friend class WriterState;
+  private:
+  tByte4 _signature;	// 0x08074b50 
+  tByte4 _crc32;	// CRC-32 checksum
+  tByte8 _csize;	// compressed file size
+  tByte8 _size;		// uncompressed file size
+
+  public:
+  unsigned crc32(void) const { return bytes2number(_crc32); }
+  uint64_t csize(void) const { return bytes2number(_csize); }
+  uint64_t size(void) const { return bytes2number(_size); }
+
+};  // class Zip64DataDescriptor
+
+
+/**
+ *  CentralHeader of a file in the central directory of a zip archive
+ *  (central file header)
+ *  The fixed length part is followed by the file name, the extra field and
+ *  the file comment.
+ */
+
+class CentralHeader {
+
+  friend class Header;
+  friend class WriterState;
+  private:
+  tByte4 _signature;	// 0x02014b50
+  tByte2 _madeby;	// version made by
+  tByte2 _version;	// version of PKZIP specification needed to extract
+  tByte2 _flags;	// bit flags
+  tByte2 _compression;	// compression method used
+  tByte2 _mtime;	// DOS modification time
+  tByte2 _mdate;	// DOS modification date
+  tByte4 _crc32;	// CRC-32 checksum
+  tByte4 _csize;	// compressed file size
+  tByte4 _size;		// uncompressed file size
+  tByte2 _fnlength;	// length of file name
+  tByte2 _extralength;	// length of extra field
+  tByte2 _cmtlength;	// length of file comment
+  tByte2 _disk;		// number of disk on which the file starts
+  tByte2 _iattr;	// internal file attributes
+  tByte4 _eattr;	// external file attributes
+  tByte4 _offset;	// offset of local header
+
+  public:
+  static const tByte signature[4];
+
+  unsigned compression(void) const { return bytes2number(_compression); }
+  unsigned crc32(void) const { return bytes2number(_crc32); }
+  uint64_t csize(void) const { return extended( 1 ); }
+  uint64_t size(void) const { return extended( 0 ); }
+  unsigned fnlength(void) const { return bytes2number(_fnlength); }
+  unsigned extralength(void) const { return bytes2number(_extralength); }
+  unsigned cmtlength(void) const { return bytes2number(_cmtlength); }
+  uint64_t offset(void) const { return extended( 2 ); }
+  unsigned hsize(void) const
+    { return sizeof(CentralHeader) + fnlength() + extralength() + cmtlength(); }
+  const char *name(void) const { return (const char *)(this + 1); }
+
+  // size (0), compressed size (1) or offset (2), the Zip64 extra field
+  // contains those of them which are set to Zip64Mark (in this order)
+  uint64_t extended( int which ) const {
+    const tByte4 *fields[3] = { &_size, &_csize, &_offset };
+    unsigned val = bytes2number( *fields[which] ), len;
+    if ( val != Zip64Mark ) return val;
+    const tByte8 *z = (const tByte8 *) findExtra( 
+      ((const tByte *) name()) + fnlength(), extralength(), Zip64Extra, &len );
+    int i = 0;
+    for ( int f = 0; f < which; f++ ) 
+      if ( bytes2number( *fields[f] ) == Zip64Mark ) i++;
+    if ( !z || (len < 8 * (unsigned)(i + 1)) )
+      throw Exception( "zip archive corrupt (zip64 extra field)" );
+    return bytes2number( z[i] );
+  }
+
+};  // class CentralHeader
+
+
+/**
+ *  End of central directory record, the last record of a zip archive
+ */
+
+class EndOfCentralDirectory {
+
+  friend class WriterState;
+  private:
+  tByte4 _signature;	// 0x06054b50
+  tByte2 _disk;		// number of this disk
+  tByte2 _cddisk;	// disk where central directory starts
+  tByte2 _ndisk;	// number of central directory records on this disk
+  tByte2 _nentries;	// total number of central directory records
+  tByte4 _cdsize;	// size of central directory
+  tByte4 _cdoffset;	// offset of central directory
+  tByte2 _cmtlength;	// length of archive comment
+
+  public:
+  static const tByte signature[4];
+
+  unsigned nentries(void) const { return bytes2number(_nentries); }
+  unsigned cdsize(void) const { return bytes2number(_cdsize); }
+  unsigned cdoffset(void) const { return bytes2number(_cdoffset); }
+
+  // are the Zip64 records to be used?
+  int isZip64(void) const {
+    return (nentries() == 0xffff) || (cdsize() == Zip64Mark) || 
+           (cdoffset() == Zip64Mark);
+  }
+
+};  // class EndOfCentralDirectory
+
+
+/**
+ *  Zip64 end of central directory record, replaces the values of the
+ *  EndOfCentralDirectory in archives with more than 65535 files or larger
+ *  than 4 GB
+ */
+
+class Zip64EndOfCentralDirectory {
+
+  friend class WriterState;
+  private:
+  tByte4 _signature;	// 0x06064b50
+  tByte8 _rsize;	// size of the remaining record
+  tByte2 _madeby;	// version made by
+  tByte2 _version;	// version needed to extract
+  tByte4 _disk;		// number of this disk
+  tByte4 _cddisk;	// disk where central directory starts
+  tByte8 _ndisk;	// number of central directory records on this disk
+  tByte8 _nentries;	// total number of central directory records
+  tByte8 _cdsize;	// size of central directory
+  tByte8 _cdoffset;	// offset of central directory
+
+  public:
+  static const tByte signature[4];
+
+  uint64_t nentries(void) const { return bytes2number(_nentries); }
+  uint64_t cdsize(void) const { return bytes2number(_cdsize); }
+  uint64_t cdoffset(void) const { return bytes2number(_cdoffset); }
+
+};  // class Zip64EndOfCentralDirectory
+
+
+/**
+ *  Zip64 end of central directory locator, directly precedes the 
+ *  EndOfCentralDirectory
+ */
+
+class Zip64Locator {
+
+  friend class WriterState;
+  private:
+  tByte4 _signature;	// 0x07064b50
+  tByte4 _disk;		// disk with the Zip64EndOfCentralDirectory
+  tByte8 _offset;	// offset of Zip64EndOfCentralDirectory
+  tByte4 _ndisks;	// total number of disks
+
+  public:
+  static const tByte signature[4];
+
+  uint64_t offset(void) const { return bytes2number(_offset); }
+
+};  // class Zip64Locator
+
+
 /**
  *  Header of a file stored in a zip archive
  *  (local file header)
@@ -68,6 +341,7 @@ class DataDescriptor {
 
 class Header {
 
+  friend class WriterState;
   private:
   tByte4 _signature;	// 0x04034b50 
   tByte2 _version;	// version of PKZIP specification needed to extract
@@ -117,6 +391,7 @@ class Header {
     Lzma		= 14,	// LZMA data compression
     IbmTerse		= 18,	// IBM Terse data compression
     Lz77		= 19,	// IBM LZ77 data compression
+    Zstd		= 93,	// Zstandard compression
     WavPack		= 97,	// WavPack compression
     PPMd		= 98	// PPMd compression
   };
@@ -124,15 +399,71 @@ class Header {
   unsigned flags(void) const { return bytes2number(_flags); }
   unsigned compression(void) const { return bytes2number(_compression); }
   unsigned crc32(void) const { return bytes2number(_crc32); }
-  unsigned csize(void) const { return bytes2number(_csize); }
-  unsigned size(void) const { return bytes2number(_size); }
+  uint64_t csize(void) const {
+    const tByte8 *z = zip64();
+    return (z && (bytes2number(_csize) == Zip64Mark))? 
+      bytes2number(z[1]) : bytes2number(_csize); 
+  }
+  uint64_t size(void) const {
+    const tByte8 *z = zip64();
+    return (z && (bytes2number(_size) == Zip64Mark))? 
+      bytes2number(z[0]) : bytes2number(_size); 
+  }
   unsigned fnlength(void) const { return bytes2number(_fnlength); }
   unsigned extralength(void) const { return bytes2number(_extralength); }
   unsigned hsize(void) const
     { return sizeof(Header) + fnlength() + extralength(); }
 
+  // Zip64 extra field (size and compressed size) or 0 if there is none,
+  // the complete header must have been read
+  tByte8 *zip64(void) const {
+    unsigned len;
+    tByte8 *z = (tByte8 *) findExtra( ((const tByte *)(this + 1)) + fnlength(), 
+                                      extralength(), Zip64Extra, &len );
+    return (z && (len >= 16))? z : 0;
+  }
+
+  // has a Zip64DataDescriptor?
+  int isZip64(void) const { return zip64() != 0; }
+
+  // modification time (DOS time is local time)
+  time_t mtime(void) const {
+    unsigned d = bytes2number(_mdate), t = bytes2number(_mtime);
+    struct tm tm;
+    memset( &tm, 0, sizeof tm );
+    tm.tm_year = ((d >> 9) & 0x7f) + 80;
+    tm.tm_mon = ((d >> 5) & 0x0f) - 1;
+    tm.tm_mday = d & 0x1f;
+    tm.tm_hour = (t >> 11) & 0x1f;
+    tm.tm_min = (t >> 5) & 0x3f;
+    tm.tm_sec = (t & 0x1f) * 2;
+    tm.tm_isdst = -1;
+    return mktime( &tm );
+  }
+
+  // sets sizes and CRC32, large sizes need a Zip64 extra field
+  void setSizes( uint64_t size, uint64_t csize, unsigned crc ) {
+    tByte8 *z = zip64();
+    number2bytes( _crc32, crc );
+    if ( z ) {
+      number2bytes( _size, Zip64Mark ); number2bytes( _csize, Zip64Mark );
+      number2bytes( z[0], size ); number2bytes( z[1], csize );
+    }
+    else if ( (size >= Zip64Mark) || (csize >= Zip64Mark) )
+      throw Exception( "zip archive corrupt (zip64 extra field missing)" );
+    else 
+      { number2bytes( _size, (unsigned) size ); 
+        number2bytes( _csize, (unsigned) csize ); }
+  }
+
   void setDataDescriptor( DataDescriptor *dd )
-    { _size = dd -> _size; _csize = dd -> _csize; _crc32 = dd -> _crc32; }
+    { setSizes( dd->size(), dd->csize(), dd->crc32() ); }
+  void setDataDescriptor( Zip64DataDescriptor *dd )
+    { setSizes( dd->size(), dd->csize(), dd->crc32() ); }
+  void setDataDescriptor( Header *h )
+    { setSizes( h->size(), h->csize(), h->crc32() ); }
+  void setDataDescriptor( const CentralHeader *ch )
+    { setSizes( ch->size(), ch->csize(), ch->crc32() ); }
 
   int hasSize(void) const { return !(flags() & DescriptorUsed); }
 
@@ -144,411 +475,3534 @@ class Header {
 // zip Header and DataDescriptor signatures:
 const tByte Header::signature[] = { 0x50, 0x4b, 0x03, 0x04 };
 const tByte DataDescriptor::signature[] = { 0x50, 0x4b, 0x07, 0x08 };
-
+const tByte CentralHeader::signature[] = { 0x50, 0x4b, 0x01, 0x02 };
+const tByte EndOfCentralDirectory::signature[] = { 0x50, 0x4b, 0x05, 0x06 };
+const tByte Zip64EndOfCentralDirectory::signature[] = { 0x50, 0x4b, 0x06, 0x06 };
+const tByte Zip64Locator::signature[] = { 0x50, 0x4b, 0x06, 0x07 };
 
 /**
- *  A Buffer is used to store data read and to scan for the signature
- *  of a zip file in a zip archive.
+ *  A Decoder decompresses a compressed stream piece by piece as the
+ *  compressed data is received. Its state is allocated once and reset 
+ *  for every stream (see begin), it is released by the destructor.
  */
 
-class Buffer {
-
-  public:
-  tByte		*_buffer;	// allocated storage
-  int		 _size;		// current buffer size
-  int		 _len;		// #bytes copied to _buffer
-  tByte		*_dd;		// data descriptor if != 0
-  int		 _flags;	// operation flags
-  const tByte	*_data;		// pointer to data to read
-  int		 _dlen;		// remainig #byte in data buffer
-  const tByte	*_signature;	// 4 byte signature to check against
-  int		 _slen;		// #bytes of signature checked
-
-  // _flags values:
-  enum {
-    Skiping	=	1,	// skip to signature
-    Copying	=	2,	// copy until signature
-    FileFound	= 	1024	// file has been successfully read
-  };
+class Decoder {
 
-  // resets the buffer
-  void reset() { _len = 0; _flags = 0; _dd = 0; }
+  protected:
+  int		 _ended;	// end of compressed stream reached
 
-  // initializes empty buffer
-  Buffer( void ) { _buffer = 0; _size = 0; reset(); }
+  public:
+  Decoder( void ) { _ended = 0; }
+  virtual ~Decoder() {}
 
-  // ~Buffer releases allocated data
-  ~Buffer() { if ( _buffer ) free( _buffer ); _buffer = 0; _size = 0; reset(); }
+  // prepares decompression of the file described by Header 'h'
+  virtual void begin( const Header *h ) = 0;
 
-  // Header read?
-  int isHeader( void ) const { return (_len >= sizeof(Header)); }
+  // end of compressed stream reached?
+  int hasEnded( void ) const { return _ended; }
 
-  // #bytes needed to complete file
-  int needed( void ) const {
-    return ( isHeader()? ( header()->hsize() + 
-                           ( header()->hasSize()? header()->csize() : 0 ) )
-	                 : sizeof(Header) ) - _len;
-  }
+  // is the end of the stream of the file described by 'h' detected 
+  // without knowing its size?
+  virtual int marksEnd( const Header *h ) const { return 1; }
 
-  // returns Pointer to Header
-  Header *header( void ) const { return (Header *) _buffer; }
+  // decompresses *ilen bytes at *in into out, returns #bytes written to out
+  virtual long decode( const tByte **in, long *ilen, tByte *out, long olen ) = 0;
 
-  // returns Pointer to DataDescriptor
-  DataDescriptor *dataDescriptor( void ) const
-    { return (DataDescriptor *) _dd; }
+  // max #bytes passed to a library at once (sizes may be 32 bit)
+  static const long MaxChunk = 1L << 30;
 
-  // returns Pointer to file contents
-  tByte *contents( void ) const {
-    return _buffer + header()->hsize();
-  }
+}; // class Decoder
 
-  // returns true if zip file was found and stored
-  int fileFound( void ) const { return _flags & FileFound; }
 
-  // increases buffer
-  void reserveSpace( int size = 20*1024 );
+/**
+ *  An Inflater decompresses deflated streams using zlib (or zlib-ng if 
+ *  ZIP_ZLIB_NG is defined), its state (including the 32K window) is kept 
+ *  for all streams.
+ */
 
-  // skip until a signature has been found
-  void skip ( void );
+class Inflater : public Decoder {
 
-  // define signature to skip to
-  void skipUntil( const tByte *signature );
+  private:
+  ZStream	 _zs;		// zlib stream state
+  int		 _active;	// inflateInit2 has been called
 
-  // copy bytes until a signature has been found
-  void copy ( void );
+  public:
+  Inflater( void ) { memset( &_zs, 0, sizeof _zs ); _active = 0; }
+  ~Inflater() { if ( _active ) ZLIB(inflateEnd)( &_zs ); }
+  void begin( const Header *h );
+  long decode( const tByte **in, long *ilen, tByte *out, long olen );
 
-  // define signature to copy to
-  void copyUntil( const tByte *signature );
+}; // class Inflater
 
-  // search for Header signature
-  void scanForHeader( void );
+void Inflater::begin( const Header *h ) {
+  if ( _active ) {
+    if ( ZLIB(inflateReset)( &_zs ) != Z_OK )
+      throw Exception( "libz: inflateReset failed" );
+  }
+  else if ( ZLIB(inflateInit2)( &_zs, -MAX_WBITS ) != Z_OK )
+    throw Exception( "libz: inflateInit2 failed" );
+  _active = 1;
+  _ended = 0;
+}
 
-  // adds data to the buffer and scans for zip file
-  void addData( const char **data, int *len );
+long Inflater::decode( const tByte **in, long *ilen, tByte *out, long olen ) {
+  int ret;
+  if ( olen > MaxChunk ) olen = MaxChunk;
+  _zs.next_in = *in;
+  _zs.avail_in = (unsigned)( (*ilen > MaxChunk)? MaxChunk : *ilen );
+  _zs.next_out = out;
+  _zs.avail_out = (unsigned) olen;
+  switch ( ret = ZLIB(inflate)( &_zs, Z_NO_FLUSH ) ) {
+    case Z_OK :
+      break;
+    case Z_STREAM_END :
+      _ended = 1;
+      break;
+    case Z_NEED_DICT :
+      throw Exception( "libz: preset dictionary needed for inflate" );
+    case Z_DATA_ERROR :
+      throw Exception( "libz: corrupt inflate input" );
+    case Z_MEM_ERROR :
+      throw Exception( "libz: not enough memory for inflate" );
+    case Z_BUF_ERROR :
+      // no progress without input is no error
+      if ( *ilen == 0 ) break;
+      throw Exception( "libz: not enough space for inflate output" );
+    case Z_STREAM_ERROR :
+      throw Exception( "libz: argument error" );
+    default:
+      debug( "inflate: %d\n", ret );
+      throw Exception( "libz: unknown inflate error" );
+  }
+  *ilen -= (long)( _zs.next_in - *in );
+  *in = _zs.next_in;
+  return olen - _zs.avail_out;
+}
 
-  // copies bytes to the buffer
-  int copyBytes( int nbytes = -1 );
+#if defined(ZIP_ZSTD)
 
-  // copies data of a zip file with known size
-  void copySized( void );
+/**
+ *  A ZstdDecoder decompresses Zstandard frames (method 93) using libzstd.
+ */
 
-  // copies data of a zip file with unknown size
-  void copyUnsized( void );
+class ZstdDecoder : public Decoder {
 
-  // allocated file name
-  char *heapFilename( void ) const;
+  private:
+  ZSTD_DStream	*_ds;		// zstd stream state
 
-}; // class Buffer
+  public:
+  ZstdDecoder( void ) { _ds = 0; }
+  ~ZstdDecoder() { if ( _ds ) ZSTD_freeDStream( _ds ); }
+  void begin( const Header *h );
+  long decode( const tByte **in, long *ilen, tByte *out, long olen );
+
+}; // class ZstdDecoder
+
+void ZstdDecoder::begin( const Header *h ) {
+  if ( !_ds && !(_ds = ZSTD_createDStream()) ) 
+    throw Exception( "zstd: not enough memory" );
+  if ( ZSTD_isError( ZSTD_DCtx_reset( _ds, ZSTD_reset_session_only ) ) )
+    throw Exception( "zstd: reset failed" );
+  _ended = 0;
+}
 
-void Buffer::reserveSpace( int size ) {
-  if ( size < 4 ) size += 4;
-  if ( _buffer ) {
-    if ( (_size - _len) < (size + 4) ) {
-      int dd_offset = 0;
-      if ( _dd ) dd_offset = (int)(_dd - _buffer);
-      _size = _size + size * 2;
-      _buffer = (tByte *) realloc( _buffer, _size * sizeof(tByte) );
-      if ( _dd ) _dd = _buffer + dd_offset;
-  } }
-  else _buffer = (tByte *) malloc( (_size = size + 4) * sizeof(tByte) );
-  if ( !_buffer ) throw Exception();
+long ZstdDecoder::decode( const tByte **in, long *ilen, tByte *out, 
+                          long olen ) {
+  ZSTD_inBuffer ib = { *in, (size_t)( (*ilen > MaxChunk)? MaxChunk : *ilen ), 0 };
+  ZSTD_outBuffer ob = { out, (size_t)( (olen > MaxChunk)? MaxChunk : olen ), 0 };
+  size_t ret = ZSTD_decompressStream( _ds, &ob, &ib );
+  if ( ZSTD_isError( ret ) ) throw Exception( ZSTD_getErrorName( ret ) );
+  if ( ret == 0 ) _ended = 1;
+  *in += ib.pos;
+  *ilen -= (long) ib.pos;
+  return (long) ob.pos;
 }
 
-void Buffer::skip( void ) {
-  while ( _dlen > 0 ) {
-    if ( _signature[_slen] == *_data++ ) _slen++;
-    else _slen = 0;
-    _dlen--;
-    if ( _slen == 4 ) {
-      // signature found, copy it to _buffer
-      memcpy( _buffer + _len, _signature, 4 );
-      _len += 4;
-      _flags &= ~Skiping;
-      return;
-} } }
+#endif
 
-void Buffer::skipUntil( const tByte *signature ) {
-  _signature = signature;
-  _slen = 0;
-  _flags |= Skiping;
-}
+#if defined(ZIP_LZMA)
 
-void Buffer::copy( void ) {
-  while ( _dlen > 0 ) {
-    _buffer[_len++] = *_data;
-    _dlen--;
-    if ( _signature[_slen] == *_data++ ) _slen++;
-    else _slen = 0;
-    if ( _slen == 4 ) {
-      // signature found, terminate copying
-      _flags &= ~Copying;
-      return;
-} } }
+/**
+ *  An LzmaDecoder decompresses LZMA streams (method 14) using liblzma.
+ *  The stream starts with 4 bytes of version and properties size followed
+ *  by the LZMA properties. The end of the stream is marked if the header
+ *  flag LzmaEOSused is set, otherwise the uncompressed size is needed.
+ */
 
-void Buffer::copyUntil( const tByte *signature ) {
-  _signature = signature;
-  _slen = 0;
-  _flags |= Copying;
-}
+class LzmaDecoder : public Decoder {
 
-void Buffer::scanForHeader( void ) {
-  if ( _len == 0 ) skipUntil( Header::signature );
-  if ( _flags & Skiping ) skip();
-  if ( _dlen > 0 ) {
-    int to_copy = sizeof(Header) - _len;
-    if ( to_copy > _dlen ) to_copy = _dlen;
-    memcpy( _buffer + _len, _data, to_copy );
-    _len += to_copy;
-    _data += to_copy;
-    _dlen -= to_copy;
-} }
+  private:
+  lzma_stream	 _ls;		// liblzma stream state
+  tByte		 _props[9];	// version, properties size and properties
+  int		 _plen;		// #bytes of _props read
+  long		 _left;		// #bytes to decode (-1: end is marked)
 
-void Buffer::addData( const char **buff, int *blen ) {
-  if ( (*blen <= 0) || fileFound() ) return;
-  reserveSpace( *blen );
-  _data = (const tByte *) *buff;
-  _dlen = *blen;
-  if ( !isHeader() ) scanForHeader();
-  if ( _dlen > 0 ) {
-    if ( header() -> hasSize() ) copySized();
-    else copyUnsized();
-  }
-  *buff = (const char *) _data;
-  *blen = _dlen;
+  public:
+  LzmaDecoder( void ) { lzma_stream ls = LZMA_STREAM_INIT; _ls = ls; }
+  ~LzmaDecoder() { lzma_end( &_ls ); }
+  void begin( const Header *h );
+  long decode( const tByte **in, long *ilen, tByte *out, long olen );
+  int marksEnd( const Header *h ) const 
+    { return h->flags() & Header::LzmaEOSused; }
+
+}; // class LzmaDecoder
+
+void LzmaDecoder::begin( const Header *h ) {
+  _plen = 0;
+  _left = ( (h->flags() & Header::LzmaEOSused) || !h->hasSize() )? 
+          -1 : (long) h->size();
+  _ended = (_left == 0);
 }
 
-int Buffer::copyBytes( int need ) {
-  int to_copy = 0;
-  if ( need < 0 ) need = needed();
-  if ( need > 0 ) {
-    to_copy = (need < _dlen)? need : _dlen;
-    memcpy( _buffer + _len, _data, to_copy );
-    _data += to_copy;
-    _dlen -= to_copy;
-    _len += to_copy;
+long LzmaDecoder::decode( const tByte **in, long *ilen, tByte *out, 
+                          long olen ) {
+  if ( _plen < (int) sizeof _props ) {
+    // read the properties and initialize the raw LZMA1 decoder
+    while ( (_plen < (int) sizeof _props) && (*ilen > 0) ) 
+      { _props[_plen++] = *(*in)++; (*ilen)--; }
+    if ( _plen < (int) sizeof _props ) return 0;
+    if ( (_props[2] | (_props[3] << 8)) != 5 ) 
+      throw Exception( "lzma: unsupported properties" );
+    lzma_filter filters[2] = 
+      { { LZMA_FILTER_LZMA1, 0 }, { LZMA_VLI_UNKNOWN, 0 } };
+    if ( lzma_properties_decode( filters, 0, _props + 4, 5 ) != LZMA_OK )
+      throw Exception( "lzma: corrupt properties" );
+    lzma_ret ret = lzma_raw_decoder( &_ls, filters );
+    free( filters[0].options );
+    if ( ret != LZMA_OK ) throw Exception( "lzma: can't create decoder" );
   }
-  return to_copy;
+  if ( olen > MaxChunk ) olen = MaxChunk;
+  if ( (_left >= 0) && (olen > _left) ) olen = _left;
+  _ls.next_in = *in;
+  _ls.avail_in = (size_t)( (*ilen > MaxChunk)? MaxChunk : *ilen );
+  _ls.next_out = out;
+  _ls.avail_out = (size_t) olen;
+  switch ( lzma_code( &_ls, LZMA_RUN ) ) {
+    case LZMA_OK : break;
+    case LZMA_STREAM_END : _ended = 1; break;
+    case LZMA_BUF_ERROR : 
+      if ( *ilen == 0 ) break;
+      throw Exception( "lzma: no progress" );
+    case LZMA_MEM_ERROR : throw Exception( "lzma: not enough memory" );
+    default: throw Exception( "lzma: corrupt input" );
+  }
+  *ilen -= (long)( _ls.next_in - *in );
+  *in = _ls.next_in;
+  olen -= (long) _ls.avail_out;
+  if ( (_left >= 0) && ((_left -= olen) == 0) ) _ended = 1;
+  return olen;
 }
 
-void Buffer::copySized( void ) {
-  copyBytes();
-  if ( needed() == 0 ) _flags |= FileFound;
-}
+#endif
 
-void Buffer::copyUnsized( void ) {
-  if ( !_dd && !(_flags & Copying) ) copyUntil( DataDescriptor::signature );
-  if ( _flags & Copying ) copy();
-  if ( _dlen > 0 ) {
-    if( !_dd ) _dd = _buffer + _len - 4;
-    int to_copy = (int)( sizeof(DataDescriptor) - (_len - (_dd - _buffer)) );
-    if ( to_copy == copyBytes( to_copy ) ) {
-      header() -> setDataDescriptor( dataDescriptor() );
-      _flags |= FileFound;
-} } }
+/**
+ *  Decoders keeps one Decoder per compression method, created when it is
+ *  needed first. Zstandard and LZMA decoders are available if ZIP_ZSTD 
+ *  resp. ZIP_LZMA are defined (linking libzstd resp. liblzma).
+ */
 
-char *Buffer::heapFilename( void ) const {
-  char *ret = 0;
-  if ( isHeader() ) {
+class Decoders {
+
+  private:
+  enum { NDecoders = 3 };
+  Decoder	*_decoders[NDecoders];	// decoders created
+
+  public:
+  Decoders( void ) { memset( _decoders, 0, sizeof _decoders ); }
+  ~Decoders() { for ( Decoder *d: _decoders ) delete d; }
+
+  // returns the Decoder for 'method', 0 for Stored files
+  Decoder *get( unsigned method );
+
+}; // class Decoders
+
+Decoder *Decoders::get( unsigned method ) {
+  int i;
+  switch ( method ) {
+    case Header::Stored: return 0;
+    case Header::Deflated: i = 0; break;
+#if defined(ZIP_ZSTD)
+    case Header::Zstd: i = 1; break;
+#endif
+#if defined(ZIP_LZMA)
+    case Header::Lzma: i = 2; break;
+#endif
+    default: throw Exception( "unsupported compression" );
+  }
+  if ( !_decoders[i] ) switch ( i ) {
+    case 0: _decoders[i] = new Inflater; break;
+#if defined(ZIP_ZSTD)
+    case 1: _decoders[i] = new ZstdDecoder; break;
+#endif
+#if defined(ZIP_LZMA)
+    case 2: _decoders[i] = new LzmaDecoder; break;
+#endif
+  }
+  return _decoders[i];
+}
+
+
+/**
+ *  inflateWhole decompresses the complete deflated data 'in' ('ilen' 
+ *  bytes) to 'out' ('olen' bytes) at once and returns the #bytes written.
+ *  This is faster than decompressing piece by piece but needs the whole
+ *  compressed file in memory, it is used if libdeflate is available
+ *  (ZIP_LIBDEFLATE, hasInflateWhole returns true).
+ */
+
+#if defined(ZIP_LIBDEFLATE)
+
+static int hasInflateWhole( void ) { return 1; }
+
+static long inflateWhole( const tByte *in, long ilen, tByte *out, long olen ) {
+  struct Decompressor {
+    libdeflate_decompressor *d;
+    Decompressor( void ) { d = libdeflate_alloc_decompressor(); }
+    ~Decompressor() { if ( d ) libdeflate_free_decompressor( d ); }
+  };
+  static thread_local Decompressor dc;	// reused by this thread
+  size_t n;
+  if ( !dc.d ) throw Exception( "libdeflate: not enough memory" );
+  switch ( libdeflate_deflate_decompress( dc.d, in, ilen, out, olen, &n ) ) {
+    case LIBDEFLATE_SUCCESS : return (long) n;
+    case LIBDEFLATE_INSUFFICIENT_SPACE : 
+      throw Exception( "zip archive corrupt (size error)" );
+    default: throw Exception( "libdeflate: corrupt deflated data" );
+} }
+
+#else
+
+static int hasInflateWhole( void ) { return 0; }
+
+static long inflateWhole( const tByte *in, long ilen, tByte *out, long olen ) {
+  throw Exception( "unsupported compression" );
+}
+
+#endif
+
+
+/**
+ *  updateCrc updates the CRC32 'crc' (initially 0) with 'len' bytes at 
+ *  'data' (like zlib's crc32). It is called for every piece of file 
+ *  contents while it is still in the cache. ARMv8 CRC32 instructions or 
+ *  PCLMULQDQ (folding 64 bytes per iteration, see Intel's "Fast CRC 
+ *  Computation Using PCLMULQDQ Instruction") are used if available, 
+ *  slicing-by-8 tables otherwise.
+ */
+
+// slicing-by-8 tables
+struct CrcTables {
+  unsigned t[8][256];
+  CrcTables( void ) {
+    for ( unsigned i = 0; i < 256; i++ ) {
+      unsigned c = i;
+      for ( int k = 0; k < 8; k++ ) c = (c & 1)? (c >> 1) ^ 0xedb88320 : c >> 1;
+      t[0][i] = c;
+    }
+    for ( unsigned i = 0; i < 256; i++ )
+      for ( int k = 1; k < 8; k++ ) 
+        t[k][i] = (t[k-1][i] >> 8) ^ t[0][t[k-1][i] & 0xff];
+  }
+}; // struct CrcTables
+
+static unsigned crcSlicing( unsigned crc, const tByte *data, size_t len ) {
+  static const CrcTables tables;
+  const unsigned (*t)[256] = tables.t;
+  for ( ; len >= 8; data += 8, len -= 8 ) {
+    unsigned lo = crc ^ (data[0] | (data[1] << 8) | (data[2] << 16) | 
+                         ((unsigned) data[3] << 24));
+    crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ 
+          t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+          t[3][data[4]] ^ t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]];
+  }
+  while ( len-- ) crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xff];
+  return crc;
+}
+
+#if defined(ZIP_CRC_PCLMUL)
+
+// folds a multiple of 16 bytes (at least 64), crc is not inverted
+__attribute__((target("sse2,pclmul")))
+static unsigned crcPclmul( unsigned crc, const tByte *data, size_t len ) {
+  const __m128i k1k2 = _mm_set_epi64x( 0x01c6e41596, 0x0154442bd4 ),
+                k3k4 = _mm_set_epi64x( 0x00ccaa009e, 0x01751997d0 ),
+                k5 = _mm_set_epi64x( 0, 0x0163cd6124 ),
+                poly = _mm_set_epi64x( 0x01f7011641, 0x01db710641 ),
+                mask = _mm_setr_epi32( ~0, 0, ~0, 0 );
+  __m128i x1 = _mm_loadu_si128( (const __m128i *) data ),
+          x2 = _mm_loadu_si128( (const __m128i *) (data + 16) ),
+          x3 = _mm_loadu_si128( (const __m128i *) (data + 32) ),
+          x4 = _mm_loadu_si128( (const __m128i *) (data + 48) ), x5;
+  x1 = _mm_xor_si128( x1, _mm_cvtsi32_si128( (int) crc ) );
+  // fold 4 blocks in parallel
+  for ( data += 64, len -= 64; len >= 64; data += 64, len -= 64 ) {
+#   define FOLD(x,off) \
+      x5 = _mm_clmulepi64_si128( x, k1k2, 0x00 ); \
+      x = _mm_clmulepi64_si128( x, k1k2, 0x11 ); \
+      x = _mm_xor_si128( _mm_xor_si128( x, x5 ), \
+            _mm_loadu_si128( (const __m128i *) (data + off) ) );
+    FOLD( x1, 0 ) FOLD( x2, 16 ) FOLD( x3, 32 ) FOLD( x4, 48 )
+#   undef FOLD
+  }
+  // fold into 128 bits
+# define FOLD(y) \
+    x5 = _mm_clmulepi64_si128( x1, k3k4, 0x00 ); \
+    x1 = _mm_clmulepi64_si128( x1, k3k4, 0x11 ); \
+    x1 = _mm_xor_si128( _mm_xor_si128( x1, x5 ), y );
+  FOLD( x2 ) FOLD( x3 ) FOLD( x4 )
+  for ( ; len >= 16; data += 16, len -= 16 ) 
+    { FOLD( _mm_loadu_si128( (const __m128i *) data ) ) }
+# undef FOLD
+  // fold into 64 bits
+  x2 = _mm_clmulepi64_si128( x1, k3k4, 0x10 );
+  x1 = _mm_xor_si128( _mm_srli_si128( x1, 8 ), x2 );
+  x2 = _mm_srli_si128( x1, 4 );
+  x1 = _mm_clmulepi64_si128( _mm_and_si128( x1, mask ), k5, 0x00 );
+  x1 = _mm_xor_si128( x1, x2 );
+  // Barrett reduction to 32 bits
+  x2 = _mm_clmulepi64_si128( _mm_and_si128( x1, mask ), poly, 0x10 );
+  x2 = _mm_clmulepi64_si128( _mm_and_si128( x2, mask ), poly, 0x00 );
+  x1 = _mm_xor_si128( x1, x2 );
+  return (unsigned) _mm_cvtsi128_si32( _mm_srli_si128( x1, 4 ) );
+}
+
+static const bool hasPclmul = __builtin_cpu_supports( "pclmul" );
+
+#endif
+
+// monotonic clock in nanoseconds
+static inline long clockNs( void ) {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static unsigned long updateCrc( unsigned long crc, const tByte *data, 
+                                size_t len ) {
+  unsigned c = ~(unsigned) crc;
+#if defined(ZIP_CRC_PCLMUL)
+  if ( hasPclmul && (len >= 64) ) {
+    size_t n = len & ~(size_t) 15;
+    c = crcPclmul( c, data, n );
+    data += n; len -= n;
+  }
+#elif defined(__ARM_FEATURE_CRC32)
+  for ( ; len >= 8; data += 8, len -= 8 ) {
+    uint64_t v;
+    memcpy( &v, data, 8 );
+    c = __crc32d( c, v );
+  }
+  while ( len > 0 ) { c = __crc32b( c, *data++ ); len--; }
+  return ~c;
+#endif
+  return ~crcSlicing( c, data, len );
+}
+
+
+/**
+ *  The standard Allocator uses malloc/realloc/free.
+ */
+
+class Malloc : public Allocator {
+  public:
+  void *alloc( size_t size ) { return malloc( size ); }
+  void release( void *ptr, size_t size ) { free( ptr ); }
+  void *resize( void *ptr, size_t size, size_t nsize ) 
+    { return realloc( ptr, nsize ); }
+}; // class Malloc
+
+Allocator &Allocator::standard( void ) {
+  static Malloc allocator;
+  return allocator;
+}
+
+void *Allocator::resize( void *ptr, size_t size, size_t nsize ) {
+  void *ret = alloc( nsize );
+  if ( ret ) {
+    memcpy( ret, ptr, (size < nsize)? size : nsize );
+    release( ptr, size );
+  }
+  return ret;
+}
+
+
+/**
+ *  All storage of zip::File's and Buffers is prefixed by a Storage record
+ *  naming the Allocator owning it and the size allocated. Hence a File
+ *  can release its storage without knowing the Stream's Allocator.
+ */
+
+struct Storage {
+  Allocator	*owner;		// Allocator used
+  size_t	 size;		// #bytes allocated (including Storage)
+};
+
+static const size_t StoragePrefix = 16;	// sizeof(Storage) rounded up
+
+// allocates 'size' bytes using Allocator 'a'
+static void *allocate( Allocator *a, size_t size ) {
+  Storage *s = (Storage *) a->alloc( size + StoragePrefix );
+  if ( !s ) throw Exception();
+  s->owner = a;
+  s->size = size + StoragePrefix;
+  return ((tByte *) s) + StoragePrefix;
+}
+
+// changes the size of storage returned by 'allocate'
+static void *reallocate( void *ptr, size_t size ) {
+  Storage *s = (Storage *)( ((tByte *) ptr) - StoragePrefix );
+  Allocator *a = s->owner;
+  s = (Storage *) a->resize( s, s->size, size + StoragePrefix );
+  if ( !s ) throw Exception();
+  s->size = size + StoragePrefix;
+  return ((tByte *) s) + StoragePrefix;
+}
+
+// releases storage returned by 'allocate'
+static void deallocate( void *ptr ) {
+  if ( ptr ) {
+    Storage *s = (Storage *)( ((tByte *) ptr) - StoragePrefix );
+    s->owner -> release( s, s->size );
+} }
+
+// returns the Allocator of storage returned by 'allocate'
+static Allocator *allocatorOf( void *ptr ) {
+  return ((Storage *)( ((tByte *) ptr) - StoragePrefix )) -> owner;
+}
+
+
+/**
+ *  PoolState is the opaque state of a zip::Pool. Blocks up to 
+ *  'slabsize'/4 bytes are rounded up to a power of 2 and carved from slabs,
+ *  released blocks are kept in free lists per size class. Larger blocks 
+ *  are allocated individually and linked to a list of large blocks.
+ */
+
+struct PoolState {
+  enum { MinClass = 6, NClasses = 48 };	// smallest block: 64 bytes
+  struct Large { Large *prev, *next; };	// header of large block
+  std::mutex	 mutex;		// protects the pool
+  size_t	 slabsize;	// size of slabs
+  std::vector<void *> slabs;	// slabs allocated
+  void		*free[NClasses]; // free lists
+  tByte		*ptr;		// unused rest of current slab
+  size_t	 left;		// #bytes at ptr
+  Large		 large;		// list of large blocks
+
+  // size class of 'size' bytes
+  static int sizeClass( size_t size ) {
+    int cls = MinClass;
+    while ( ((size_t) 1 << cls) < size ) cls++;
+    return cls;
+  }
+  int isLarge( size_t size ) const { return size > slabsize/4; }
+
+  PoolState( size_t ssize ) { slabsize = ssize; init(); }
+  ~PoolState() { clear(); }
+  void init( void ) {
+    memset( free, 0, sizeof free );
+    ptr = 0; left = 0;
+    large.prev = large.next = &large;
+  }
+  void clear( void ) {
+    for ( void *slab: slabs ) ::free( slab );
+    slabs.clear();
+    for ( Large *l = large.next; l != &large; ) 
+      { Large *n = l->next; ::free( l ); l = n; }
+    init();
+  }
+  void link( Large *l ) 
+    { l->next = large.next; l->prev = &large; large.next->prev = l; large.next = l; }
+  void unlink( Large *l ) 
+    { l->prev->next = l->next; l->next->prev = l->prev; }
+}; // struct PoolState
+
+Pool::Pool( size_t slabsize ) {
+  _state = new PoolState( slabsize );
+}
+
+Pool::~Pool() {
+  delete (PoolState *) _state;
+  _state = 0;
+}
+
+void *Pool::alloc( size_t size ) {
+  PoolState *ps = (PoolState *) _state;
+  std::lock_guard<std::mutex> lock( ps->mutex );
+  if ( ps->isLarge( size ) ) {
+    PoolState::Large *l = (PoolState::Large *) malloc( size + StoragePrefix );
+    if ( !l ) return 0;
+    ps->link( l );
+    return ((tByte *) l) + StoragePrefix;
+  }
+  int cls = PoolState::sizeClass( size );
+  void *ret = ps->free[cls];
+  if ( ret ) ps->free[cls] = *(void **) ret;
+  else {
+    size_t bsize = (size_t) 1 << cls;
+    if ( ps->left < bsize ) {
+      // the rest of the current slab is lost
+      if ( !(ps->ptr = (tByte *) malloc( ps->slabsize )) ) 
+        { ps->left = 0; return 0; }
+      ps->slabs.push_back( ps->ptr );
+      ps->left = ps->slabsize;
+    }
+    ret = ps->ptr;
+    ps->ptr += bsize;
+    ps->left -= bsize;
+  }
+  return ret;
+}
+
+void Pool::release( void *ptr, size_t size ) {
+  PoolState *ps = (PoolState *) _state;
+  std::lock_guard<std::mutex> lock( ps->mutex );
+  if ( ps->isLarge( size ) ) {
+    PoolState::Large *l = 
+      (PoolState::Large *)( ((tByte *) ptr) - StoragePrefix );
+    ps->unlink( l );
+    free( l );
+  }
+  else {
+    int cls = PoolState::sizeClass( size );
+    *(void **) ptr = ps->free[cls];
+    ps->free[cls] = ptr;
+} }
+
+void *Pool::resize( void *ptr, size_t size, size_t nsize ) {
+  PoolState *ps = (PoolState *) _state;
+  if ( ps->isLarge( size ) && ps->isLarge( nsize ) ) {
+    std::lock_guard<std::mutex> lock( ps->mutex );
+    PoolState::Large *l = 
+      (PoolState::Large *)( ((tByte *) ptr) - StoragePrefix );
+    ps->unlink( l );
+    PoolState::Large *nl = 
+      (PoolState::Large *) realloc( l, nsize + StoragePrefix );
+    if ( !nl ) { ps->link( l ); return 0; }
+    ps->link( nl );
+    return ((tByte *) nl) + StoragePrefix;
+  }
+  if ( !ps->isLarge( size ) && !ps->isLarge( nsize ) &&
+       (PoolState::sizeClass( size ) == PoolState::sizeClass( nsize )) )
+    return ptr;
+  return Allocator::resize( ptr, size, nsize );
+}
+
+void Pool::clear( void ) {
+  PoolState *ps = (PoolState *) _state;
+  std::lock_guard<std::mutex> lock( ps->mutex );
+  ps->clear();
+}
+
+
+/**
+ *  findSignature returns a pointer to the first position in [ptr,end) where
+ *  the 4 byte signature 'sig' starts. If the signature is found only 
+ *  partially at the end of the data, the position of this partial match 
+ *  is returned, 'end' if the signature can't be found.
+ *  Candidates are searched for 16 bytes at a time by comparing the first
+ *  two signature bytes using SSE2 or NEON (memchr otherwise).
+ */
+
+static inline int matchesSignature( const tByte *ptr, const tByte *end, 
+                                    const tByte *sig ) {
+  for ( int i = 0; i < 4; i++ ) {
+    if ( ptr + i >= end ) return 1;
+    if ( ptr[i] != sig[i] ) return 0;
+  }
+  return 1;
+}
+
+static const tByte *findSignature( const tByte *ptr, const tByte *end, 
+                                   const tByte *sig ) {
+#if defined(__SSE2__)
+  const __m128i s0 = _mm_set1_epi8( (char) sig[0] ), 
+                s1 = _mm_set1_epi8( (char) sig[1] );
+  for ( ; ptr + 17 <= end; ptr += 16 ) {
+    __m128i a = _mm_loadu_si128( (const __m128i *) ptr ),
+            b = _mm_loadu_si128( (const __m128i *) (ptr + 1) );
+    unsigned m = (unsigned) _mm_movemask_epi8( 
+      _mm_and_si128( _mm_cmpeq_epi8( a, s0 ), _mm_cmpeq_epi8( b, s1 ) ) );
+    for ( ; m; m &= m - 1 ) {
+      const tByte *cand = ptr + __builtin_ctz( m );
+      if ( matchesSignature( cand, end, sig ) ) return cand;
+  } }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+  const uint8x16_t s0 = vdupq_n_u8( sig[0] ), s1 = vdupq_n_u8( sig[1] );
+  for ( ; ptr + 17 <= end; ptr += 16 ) {
+    uint8x16_t eq = vandq_u8( vceqq_u8( vld1q_u8( ptr ), s0 ), 
+                              vceqq_u8( vld1q_u8( ptr + 1 ), s1 ) );
+    // 4 bits per byte of the comparison result
+    uint64_t m = vget_lane_u64( vreinterpret_u64_u8( 
+      vshrn_n_u16( vreinterpretq_u16_u8( eq ), 4 ) ), 0 );
+    while ( m ) {
+      int i = __builtin_ctzll( m ) >> 2;
+      m &= ~(0xfULL << (4*i));
+      const tByte *cand = ptr + i;
+      if ( matchesSignature( cand, end, sig ) ) return cand;
+  } }
+#endif
+  while ( ptr < end ) {
+    ptr = (const tByte *) memchr( ptr, sig[0], end - ptr );
+    if ( !ptr ) return end;
+    if ( matchesSignature( ptr, end, sig ) ) return ptr;
+    ptr++;
+  }
+  return end;
+}
+
+
+/**
+ *  A Buffer is used to scan for the signature of a zip file in a zip archive
+ *  and to store its header. The file data following the header is not
+ *  buffered but decompressed as it is received, only the uncompressed file
+ *  contents are stored behind the header.
+ *  If the StreamDelegate wants to receive the file in chunks, the file 
+ *  contents are not stored at all but passed to the delegate in pieces
+ *  of at most 'WindowSize' bytes.
+ */
+
+class Buffer {
+
+  public:
+  tByte		*_buffer;	// allocated storage (header + file contents)
+  long		 _size;		// current buffer size
+  long		 _len;		// #bytes of header copied to _buffer
+  long		 _olen;		// #bytes of file contents stored in _buffer
+  long		 _clen;		// #bytes of compressed data consumed
+  tByte		 _dd[sizeof(Zip64DataDescriptor)]; // data descriptor
+  int		 _ddlen;	// #bytes of data descriptor read
+  int		 _ddsize;	// size of data descriptor
+  int		 _flags;	// operation flags
+  const tByte	*_data;		// pointer to data to read
+  long		 _dlen;		// remainig #byte in data buffer
+  const tByte	*_signature;	// 4 byte signature to check against
+  int		 _slen;		// #bytes of signature checked
+  Decoders	 _decoders;	// decoders by compression method
+  Decoder	*_decoder;	// decoder of current file (0: stored)
+  StreamDelegate *_delegate;	// delegate receiving chunks
+  File		*_file;		// file currently read
+  tByte		*_window;	// decompressed chunk to pass to delegate
+  int		 _wlen;		// #bytes in _window
+  unsigned long	 _crc;		// CRC32 of file contents read
+  int		 _defer;	// store compressed data, File::inflate decompresses
+  int		 _lazy;		// defer decompression if not multi-threaded
+  int		 _zerocopy;	// refer to stored data in the data buffer
+  int		 _mapped;	// the data buffer stays valid (see scanMapped)
+  const tByte	*_view;		// stored file contents in the data buffer
+  Allocator	*_allocator;	// provides _buffer and Files
+  StreamStats	 _stats;	// counters of the Stream
+
+  // _flags values:
+  enum {
+    Skiping	=	1,	// skip to signature
+    Copying	=	2,	// copy until signature
+    Descriptor	=	4,	// reading data descriptor
+    HeaderFound	=	8,	// complete header has been read
+    Chunked	=	16,	// file contents are passed in chunks
+    Valid	=	32,	// size and CRC32 of chunked file are valid
+    Compressed	=	64,	// compressed file data is stored as is
+    View	=	128,	// stored file contents (or compressed data if 
+    				// mapped) are in the data buffer
+    Rejected	=	256,	// file data is skipped (see shouldAccept)
+    Whole	=	512,	// deflated file is in the data buffer
+    FileFound	= 	1024,	// file has been successfully read
+    Decoding	=	2048	// decode until the compressed stream ends
+  };
+
+  // size of _window
+  static const int WindowSize = 256*1024;
+
+  // resets the buffer
+  void reset() {
+    _len = _olen = _clen = _ddlen = _wlen = 0; _flags = 0; _decoder = 0;
+    if ( _file ) delete _file;
+    _file = 0;
+  }
+
+  // initializes empty buffer
+  Buffer( StreamDelegate *delegate, Allocator *allocator ) 
+  { _buffer = _window = 0; _size = 0; _file = 0; _delegate = delegate; 
+    _allocator = allocator; _defer = _lazy = _zerocopy = _mapped = 0; 
+    reset(); }
+
+  // ~Buffer releases allocated data
+  ~Buffer() {
+    deallocate( _buffer ); 
+    if ( _window ) free( _window ); 
+    _buffer = _window = 0; _size = 0; reset(); 
+  }
+
+  // Header read?
+  int isHeader( void ) const { return (_len >= sizeof(Header)); }
+
+  // #bytes needed to complete the header
+  long needed( void ) const 
+    { return (long)( isHeader()? header()->hsize() : sizeof(Header) ) - _len; }
+
+  // returns Pointer to Header
+  Header *header( void ) const { return (Header *) _buffer; }
+
+  // returns Pointer to DataDescriptor
+  DataDescriptor *dataDescriptor( void ) const
+    { return (DataDescriptor *) _dd; }
+
+  // returns Pointer to Zip64DataDescriptor
+  Zip64DataDescriptor *zip64DataDescriptor( void ) const
+    { return (Zip64DataDescriptor *) _dd; }
+
+  // returns Pointer to file contents
+  tByte *contents( void ) const {
+    return _buffer + header()->hsize();
+  }
+
+  // returns true if zip file was found and stored
+  int fileFound( void ) const { return _flags & FileFound; }
+
+  // returns true if the file contents are passed in chunks
+  int isChunked( void ) const { return _flags & Chunked; }
+
+  // returns true if a chunked file has been read without errors
+  int isValid( void ) const { return _flags & Valid; }
+
+  // returns true if compressed file data is stored without decompression
+  int isCompressed( void ) const { return _flags & Compressed; }
+
+  // returns true if the file contents are referenced in the data buffer
+  int isView( void ) const { return _flags & View; }
+
+  // returns true if the delegate doesn't want the file
+  int isRejected( void ) const { return _flags & Rejected; }
+
+  // returns true if the file is inflated at once from the data buffer
+  int isWhole( void ) const { return _flags & Whole; }
+
+  // passes the File read to the caller
+  File *file( void ) { File *ret = _file; _file = 0; return ret; }
+
+  // increases buffer to hold at least 'size' additional bytes
+  void reserveSpace( long size = 1024 );
+
+  // passes ownership of the allocated storage to the caller
+  tByte *release( void ) 
+    { tByte *ret = _buffer; _buffer = 0; _size = 0; return ret; }
+
+  // skip until a signature has been found
+  void skip ( void );
+
+  // define signature to skip to
+  void skipUntil( const tByte *signature );
+
+  // consume file data until a signature has been found
+  void copy ( void );
+
+  // define signature to copy to
+  void copyUntil( const tByte *signature );
+
+  // search for Header signature
+  void scanForHeader( void );
+
+  // adds data to the buffer and scans for zip file
+  void addData( const char **data, long *len );
+
+  // copies bytes to the buffer
+  long copyBytes( long nbytes = -1 );
+
+  // prepares reading of file data after the header has been read
+  void startData( void );
+
+  // decompresses file data and stores it behind the header, returns the
+  // #bytes following the end of the compressed stream
+  long consume( const tByte *data, long len );
+
+  // passes a chunk of decompressed data to the delegate
+  void deliver( const tByte *data, long len );
+
+  // checks the file data after the last byte has been consumed
+  void finish( void );
+
+  // consumes data of a zip file with known size
+  void copySized( void );
+
+  // consumes data of a zip file with unknown size
+  void copyUnsized( void );
+
+  // reads the data descriptor following a file with unknown size
+  void readDescriptor( void );
+
+  // allocated file name
+  char *heapFilename( void ) const;
+
+  // updateCrc and _decoder->decode counting the time spent
+  unsigned long checksum( unsigned long crc, const tByte *data, long len ) {
+    long t0 = clockNs();
+    crc = updateCrc( crc, data, len );
+    _stats.crcNs += clockNs() - t0;
+    return crc;
+  }
+  long decode( const tByte **in, long *ilen, tByte *out, long olen ) {
+    long t0 = clockNs();
+    long n = _decoder->decode( in, ilen, out, olen );
+    _stats.decodeNs += clockNs() - t0;
+    return n;
+  }
+
+}; // class Buffer
+
+void Buffer::reserveSpace( long size ) {
+  long used = _len + _olen;
+  if ( _buffer ) {
+    if ( (_size - used) < size ) {
+      // geometric growth, data without size grows chunk by chunk
+      _size = std::max( used + size, 2 * _size );
+      _buffer = (tByte *) reallocate( _buffer, _size * sizeof(tByte) );
+      _stats.reallocs++;
+  } }
+  else _buffer = (tByte *) allocate( _allocator, 
+                                     (_size = used + size) * sizeof(tByte) );
+  if ( _size > _stats.peakBuffer ) _stats.peakBuffer = _size;
+}
+
+void Buffer::skip( void ) {
+  // signature bytes held back are counted when skipped
+  long held = _slen, dlen = _dlen;
+  while ( _dlen > 0 ) {
+    if ( _slen == 0 ) {
+      const tByte *ptr = findSignature( _data, _data + _dlen, _signature );
+      _dlen -= (long)(ptr - _data);
+      _data = ptr;
+      if ( _dlen == 0 ) break;
+    }
+    if ( _signature[_slen] == *_data ) { _data++; _dlen--; _slen++; }
+    else if ( _slen > 0 ) _slen = 0;
+    else { _data++; _dlen--; }
+    if ( _slen == 4 ) {
+      // signature found, copy it to _buffer
+      memcpy( _buffer + _len, _signature, 4 );
+      _len += 4;
+      _flags &= ~Skiping;
+      break;
+  } }
+  _stats.skipped += dlen - _dlen - (_slen - held);
+}
+
+void Buffer::skipUntil( const tByte *signature ) {
+  _signature = signature;
+  _slen = 0;
+  _flags |= Skiping;
+}
+
+/**
+ *  Buffer::copy passes all bytes preceeding the signature to 'consume'
+ *  in a single run. Bytes matching the beginning of the signature at the
+ *  end of the data buffer are held back until the next call to 'copy'.
+ */
+
+void Buffer::copy( void ) {
+  const tByte *ptr = _data, *end = _data + _dlen;
+  int held = _slen;	// signature bytes held back from previous call
+  while ( ptr < end ) {
+    if ( _slen == 0 ) {
+      // skip bytes not starting a signature
+      if ( (ptr = findSignature( ptr, end, _signature )) == end ) break;
+    }
+    if ( _signature[_slen] == *ptr ) {
+      ptr++;
+      if ( ++_slen == 4 ) break;
+    }
+    else if ( _slen > 0 ) {
+      // no signature, bytes held back are file data
+      if ( held ) { consume( _signature, held ); held = 0; }
+      _slen = 0;
+    }
+    else ptr++;
+  }
+  consume( _data, (long)(ptr - _data) - (_slen - held) );
+  _dlen -= (long)(ptr - _data);
+  _data = ptr;
+  if ( _slen == 4 ) {
+    // signature found, terminate copying
+    memcpy( _dd, _signature, 4 );
+    _ddlen = 4;
+    _flags &= ~Copying;
+    _flags |= Descriptor;
+} }
+
+void Buffer::copyUntil( const tByte *signature ) {
+  _signature = signature;
+  _slen = 0;
+  _flags |= Copying;
+}
+
+void Buffer::scanForHeader( void ) {
+  if ( (_len == 0) && !(_flags & Skiping) ) skipUntil( Header::signature );
+  if ( _flags & Skiping ) skip();
+  if ( (_len > 0) && (_dlen > 0) ) {
+    if ( !isHeader() ) copyBytes();
+    if ( isHeader() ) {
+      reserveSpace( needed() );
+      copyBytes();
+      if ( needed() == 0 ) startData();
+} } }
+
+void Buffer::addData( const char **buff, long *blen ) {
+  if ( (*blen <= 0) || fileFound() ) return;
+  if ( !_buffer ) reserveSpace();
+  _data = (const tByte *) *buff;
+  _dlen = *blen;
+  if ( !(_flags & HeaderFound) ) scanForHeader();
+  if ( _flags & HeaderFound ) {
+    if ( header() -> hasSize() ) copySized();
+    else if ( _dlen > 0 ) copyUnsized();
+  }
+  *buff = (const char *) _data;
+  *blen = _dlen;
+}
+
+long Buffer::copyBytes( long need ) {
+  long to_copy = 0;
+  if ( need < 0 ) need = needed();
+  if ( need > 0 ) {
+    to_copy = (need < _dlen)? need : _dlen;
+    memcpy( _buffer + _len, _data, to_copy );
+    _data += to_copy;
+    _dlen -= to_copy;
+    _len += to_copy;
+  }
+  return to_copy;
+}
+
+void Buffer::startData( void ) {
+  Header *h = header();
+  int sized = h->hasSize();
+  _file = new( *_allocator ) File( this );
+  _ddsize = h->isZip64()? sizeof(Zip64DataDescriptor) : sizeof(DataDescriptor);
+  Decoder *decoder = _decoders.get( h->compression() );
+  // without sizes the decoder finds the end of the file data, the 
+  // signature of the data descriptor is only searched for otherwise
+  int decodeEnd = !sized && decoder && decoder->marksEnd( h );
+  if ( !_delegate -> shouldAccept( _file ) ) {
+    // the file data is only counted (resp. decoded to the window to find
+    // its end)
+    _flags |= Rejected | HeaderFound;
+    if ( decodeEnd ) {
+      if ( !_window && !(_window = (tByte *) malloc( WindowSize )) ) 
+        throw Exception();
+      (_decoder = decoder) -> begin( h );
+      _flags |= Decoding;
+    }
+    else if ( !sized ) 
+      { _stats.unsized++; copyUntil( DataDescriptor::signature ); }
+    return;
+  }
+  _crc = 0;
+  if ( _delegate -> beginFile( _file ) ) {
+    _flags |= Chunked;
+    if ( !_window && !(_window = (tByte *) malloc( WindowSize )) ) 
+      throw Exception();
+  }
+  else {
+    // unsized files are decoded at once to find their end
+    if ( decoder && _defer && !decodeEnd ) {
+      _flags |= Compressed;
+      if ( _mapped && sized && ((uint64_t) _dlen >= h->csize()) ) 
+        _flags |= View;
+    }
+    else if ( !decoder && sized && (_zerocopy || _mapped) && 
+              ((uint64_t) _dlen >= h->csize()) )
+      _flags |= View;
+    else if ( decoder && sized && ((uint64_t) _dlen >= h->csize()) && 
+              hasInflateWhole() && (h->compression() == Header::Deflated) )
+      _flags |= Whole;
+    // reserveSpace may move the header
+    if ( sized && !isView() ) {
+      reserveSpace( (isCompressed()? h->csize() : h->size()) + 4 );
+      h = header();
+  } }
+  if ( decoder && !isCompressed() && !isWhole() ) 
+    (_decoder = decoder) -> begin( h );
+  if ( decodeEnd ) _flags |= Decoding;
+  else if ( !sized ) { _stats.unsized++; copyUntil( DataDescriptor::signature ); }
+  _flags |= HeaderFound;
+}
+
+void Buffer::deliver( const tByte *data, long len ) {
+  if ( len > 0 ) {
+    _crc = checksum( _crc, data, len );
+    _delegate -> handleChunk( _file, data, len );
+} }
+
+long Buffer::consume( const tByte *data, long len ) {
+  _clen += len;
+  if ( isRejected() ) {
+    if ( !_decoder ) return 0;
+    // the output is discarded
+    while ( !_decoder->hasEnded() ) {
+      long n = decode( &data, &len, _window, WindowSize );
+      if ( (len == 0) && (n < WindowSize) ) break;
+  } }
+  else if ( isChunked() ) {
+    if ( !_decoder ) {
+      deliver( data, len );
+      _olen += len;
+      return 0;
+    }
+    else while ( !_decoder->hasEnded() ) {
+      // decoders may hold output back if the window is full
+      int n = (int) decode( &data, &len, _window + _wlen, 
+                            WindowSize - _wlen );
+      _wlen += n;
+      _olen += n;
+      if ( _wlen == WindowSize ) { deliver( _window, _wlen ); _wlen = 0; }
+      else if ( len == 0 ) break;
+  } }
+  else if ( !_decoder ) {
+    reserveSpace( len + 4 );
+    memcpy( contents() + _olen, data, len );
+    if ( !isCompressed() ) _crc = checksum( _crc, contents() + _olen, len );
+    _olen += len;
+    return 0;
+  }
+  else while ( !_decoder->hasEnded() ) {
+    if ( !header()->hasSize() && ((_size - _len - _olen) < 4096) )
+      reserveSpace( _olen + 64*1024 );
+    long space = _size - _len - _olen;
+    if ( space == 0 ) throw Exception( "zip archive corrupt (size error)" );
+    long n = decode( &data, &len, contents() + _olen, space );
+    _crc = checksum( _crc, contents() + _olen, n );
+    _olen += n;
+    if ( (len == 0) && (n < space) ) break;
+  }
+  // bytes behind the compressed stream are not file data
+  _clen -= len;
+  return len;
+}
+
+void Buffer::finish( void ) {
+  Header *h = header();
+  int method;
+  switch ( h->compression() ) {
+    case Header::Stored:	method = StreamStats::Stored; break;
+    case Header::Deflated:	method = StreamStats::Deflated; break;
+    case Header::Zstd:		method = StreamStats::Zstd; break;
+    case Header::Lzma:		method = StreamStats::Lzma; break;
+    default:			method = StreamStats::Other; break;
+  }
+  _stats.bytes[method] += _clen;
+  if ( isRejected() ) {
+    if ( (uint64_t) _clen != h->csize() )
+      throw Exception( "zip archive corrupt (size error)" );
+    _stats.entries++;
+    _stats.rejected++;
+    _flags |= FileFound;
+    return;
+  }
+  if ( _decoder && !_decoder->hasEnded() )
+    throw Exception( "zip archive corrupt (incomplete compressed data)" );
+  if ( isChunked() ) {
+    // the delegate is informed about errors in endFile
+    deliver( _window, _wlen );
+    _wlen = 0;
+    ((Header *) _file->header()) -> setDataDescriptor( h );
+    if ( ((uint64_t) _olen == h->size()) && 
+         ((uint64_t) _clen == h->csize()) && 
+         (_crc == h->crc32()) ) _flags |= Valid;
+  }
+  else if ( isCompressed() ) {
+    // File::inflate decompresses and checks the file
+    if ( (uint64_t) _clen != h->csize() )
+      throw Exception( "zip archive corrupt (size error)" );
+    _file -> setContents( this );
+  }
+  else {
+    if ( ((uint64_t) _olen != h->size()) || 
+         ((uint64_t) _clen != h->csize()) )
+      throw Exception( "zip archive corrupt (size error)" );
+    if ( _crc != h->crc32() )
+      throw Exception( "zip archive corrupt (CRC32 error)" );
+    _file -> setContents( this );
+  }
+  _stats.entries++;
+  _flags |= FileFound;
+}
+
+void Buffer::copySized( void ) {
+  long to_copy = (long) header()->csize() - _clen;
+  if ( to_copy > _dlen ) to_copy = _dlen;
+  if ( isView() ) { 
+    _view = _data; _clen = _olen = to_copy; 
+    if ( !isCompressed() ) _crc = checksum( 0, _view, to_copy );
+  }
+  else if ( isWhole() ) {
+    _clen = to_copy;
+    long t0 = clockNs();
+    _olen = inflateWhole( _data, to_copy, contents(), header()->size() );
+    _stats.decodeNs += clockNs() - t0;
+    _crc = checksum( 0, contents(), _olen );
+  }
+  else consume( _data, to_copy );
+  _data += to_copy;
+  _dlen -= to_copy;
+  if ( (uint64_t) _clen == header()->csize() ) finish();
+}
+
+/**
+ *  Buffer::copyUnsized decompresses the file data until the decoder finds
+ *  the end of the compressed stream (Decoding), so the data need not be 
+ *  searched for the signature of the data descriptor, which might also 
+ *  appear in compressed data. This applies to rejected files and in lazy
+ *  or threaded mode as well. Stored files are copied until the signature
+ *  is found (Copying). The data descriptor read is then 
+ *  checked against the file data by 'finish'.
+ */
+
+void Buffer::copyUnsized( void ) {
+  if ( _flags & Decoding ) {
+    long rest = consume( _data, _dlen );
+    _data += _dlen - rest;
+    _dlen = rest;
+    if ( _decoder->hasEnded() ) {
+      _ddlen = 0;
+      _flags &= ~Decoding;
+      _flags |= Descriptor;
+  } }
+  if ( _flags & Copying ) copy();
+  if ( (_flags & Descriptor) && (_dlen > 0) ) readDescriptor();
+}
+
+void Buffer::readDescriptor( void ) {
+  while ( (_dlen > 0) && (_ddlen < _ddsize) ) {
+    // the signature is read first, it is optional
+    int to_copy = ((_ddlen < 4)? 4 : _ddsize) - _ddlen;
+    if ( to_copy > _dlen ) to_copy = (int) _dlen;
+    memcpy( _dd + _ddlen, _data, to_copy );
+    _data += to_copy;
+    _dlen -= to_copy;
+    _ddlen += to_copy;
+    if ( (_ddlen == 4) && memcmp( _dd, DataDescriptor::signature, 4 ) ) {
+      memmove( _dd + 4, _dd, 4 );
+      memcpy( _dd, DataDescriptor::signature, 4 );
+      _ddlen = 8;
+  } }
+  if ( _ddlen == _ddsize ) {
+    if ( _ddsize == sizeof(Zip64DataDescriptor) )
+      header() -> setDataDescriptor( zip64DataDescriptor() );
+    else header() -> setDataDescriptor( dataDescriptor() );
+    finish();
+} }
+
+char *Buffer::heapFilename( void ) const {
+  char *ret = 0;
+  if ( isHeader() ) {
     int l = header() -> fnlength();
-    ret = (char *) malloc( (l+1) * sizeof(char) );
-    if ( ret ) {
-      memcpy( ret, _buffer + sizeof(Header), l * sizeof(char) );
-      ret[l] = '\0';
+    ret = (char *) allocate( _allocator, (l+1) * sizeof(char) );
+    memcpy( ret, _buffer + sizeof(Header), l * sizeof(char) );
+    ret[l] = '\0';
+  }
+  return ret;
+}
+
+/**
+ *  Header::toAscii writes an ascii representation of a zip Header to 
+ *  the given buffer.
+ */
+
+int Header::toAscii( char *buff, int olen ) {
+  const char *compr = "";
+  int len = olen;
+  switch ( compression() ) {
+    case Stored:	compr = "Stored"; break;
+    case Shrunk:	compr = "Shrunk"; break;
+    case Reduced1:	compr = "Reduced1"; break;
+    case Reduced2:	compr = "Reduced2"; break;
+    case Reduced3:	compr = "Reduced3"; break;
+    case Reduced4:	compr = "Reduced4"; break;
+    case Imploded:	compr = "Imploded"; break;
+    case Deflated:	compr = "Deflated"; break;
+    case Deflated64:	compr = "Deflated64"; break;
+    case LibImploded:	compr = "LibImploded"; break;
+    case Bzip2:		compr = "Bzip2"; break;
+    case Lzma:		compr = "Lzma"; break;
+    case IbmTerse:	compr = "IbmTerse"; break;
+    case Lz77:		compr = "Lz77"; break;
+    case Zstd:		compr = "Zstd"; break;
+    case WavPack:	compr = "WavPack"; break;
+    case PPMd:		compr = "PPMd"; break;
+  }
+  int l = snprintf( buff, len, "%s", compr );
+  buff += l; len -= l;
+  if ( flags() & Encrypted ) {
+    l = snprintf( buff, len, ", encrypted" );
+    buff += l; len -= l;
+  }
+  if ( flags() & Utf8Encoded ) {
+    l = snprintf( buff, len, ", utf8" );
+    buff += l; len -= l;
+  }
+  if ( flags() & DescriptorUsed ) {
+    l = snprintf( buff, len, ", +DataDescriptor" );
+    buff += l; len -= l;
+  }
+  l = snprintf( buff, len, " (size=%llu, %llu compressed, crc32=0x%x)",
+    (unsigned long long) size(), (unsigned long long) csize(), crc32() );
+  buff += l; len -= l;
+  return olen - len;
+}
+
+
+/**
+ *  File::File takes a Buffer* (opaque) containing the header of a file 
+ *  and copies the header.
+ */
+
+File::File( void *buffer ) {
+  Buffer *b = (Buffer *) buffer;
+  Header *h = b -> header();
+  _header = allocate( b->_allocator, h->hsize() );
+  memcpy( _header, h, h->hsize() );
+  try { _name = b->heapFilename(); }
+  catch ( ... ) { deallocate( _header ); throw; }
+  _data = 0;
+  _flags = 0;
+}
+
+
+/**
+ *  File::setContents takes over the storage of a Buffer* (opaque) 
+ *  containing the completely read and decompressed file.
+ */
+
+void File::setContents( void *buffer ) {
+  Buffer *b = (Buffer *) buffer;
+  Header *h = b -> header();
+  deallocate( _header );
+  if ( b->isCompressed() && b->isView() ) 
+    { _data = (void *) b->_view; _flags |= Compressed | View; }
+  else if ( b->isCompressed() ) { _data = 0; _flags |= Compressed; }
+  else if ( b->isView() ) 
+    { _data = (h->size() > 0)? (void *) b->_view : 0; _flags |= View; }
+  else if ( h->size() > 0 ) _data = b->contents();
+  else _data = 0;
+  _header = b->release();
+}
+
+
+/**
+ *  decompress decompresses the complete file data 'in' described by the
+ *  Header 'h' to 'out' (h->size() + 4 bytes) and checks the CRC32 checksum.
+ */
+
+static void decompress( const Header *h, const tByte *in, tByte *out ) {
+  static thread_local Decoders decoders;	// reused by this thread
+  long n = (long) h->size();
+  Decoder *decoder = decoders.get( h->compression() );
+  if ( !decoder ) {
+    if ( h->csize() != (uint64_t) n ) 
+      throw Exception( "zip archive corrupt (size error)" );
+    memcpy( out, in, n );
+    if ( updateCrc( 0, out, n ) != h->crc32() )
+      throw Exception( "zip archive corrupt (CRC32 error)" );
+    return;
+  }
+  long ilen = (long) h->csize(), olen = 0;
+  unsigned long crc = 0;
+  if ( hasInflateWhole() && (h->compression() == Header::Deflated) ) {
+    if ( inflateWhole( in, ilen, out, n ) != n )
+      throw Exception( "zip archive corrupt (size error)" );
+    if ( updateCrc( 0, out, n ) != h->crc32() )
+      throw Exception( "zip archive corrupt (CRC32 error)" );
+    return;
+  }
+  decoder -> begin( h );
+  // decompress in pieces to compute the CRC32 while they are in the cache
+  while ( !decoder->hasEnded() && (olen < n + 4) ) {
+    long m = n + 4 - olen;
+    if ( m > 64*1024 ) m = 64*1024;
+    long k = decoder->decode( &in, &ilen, out + olen, m );
+    crc = updateCrc( crc, out + olen, k );
+    olen += k;
+    if ( (ilen == 0) && (k < m) ) break;
+  }
+  if ( !decoder->hasEnded() )
+    throw Exception( "zip archive corrupt (incomplete compressed data)" );
+  if ( olen != n )
+    throw Exception( "zip archive corrupt (size error)" );
+  if ( crc != h->crc32() )
+    throw Exception( "zip archive corrupt (CRC32 error)" );
+}
+
+
+/**
+ *  File::inflate decompresses the file contents if they have been stored
+ *  compressed (see Stream::setThreads and Stream::setLazy) and checks the 
+ *  CRC32 checksum. It is called by File::data if necessary. The compressed 
+ *  data is stored behind the header or referenced in the data passed to 
+ *  Stream::scanMapped (File::isView).
+ */
+
+void File::inflate( void ) {
+  if ( !(_flags & Compressed) ) return;
+  Header *h = (Header *) _header;
+  const tByte *in = (_flags & View)? 
+    (const tByte *) _data : ((tByte *) _header) + h->hsize();
+  tByte *block = (tByte *) 
+    allocate( allocatorOf( _header ), h->hsize() + h->size() + 4 );
+  try { decompress( h, in, block + h->hsize() ); }
+  catch ( ... ) { deallocate( block ); throw; }
+  memcpy( block, h, h->hsize() );
+  deallocate( _header );
+  _header = block;
+  h = (Header *) block;
+  _data = (h->size() > 0)? block + h->hsize() : 0;
+  _flags &= ~(Compressed | View);
+}
+
+
+/**
+ *  File::keep copies file contents (or compressed data) referenced in the
+ *  data passed to Stream::scan (see Stream::setZeroCopy and 
+ *  Stream::scanMapped) to storage owned by the File.
+ */
+
+void File::keep( void ) {
+  if ( !(_flags & View) ) return;
+  Header *h = (Header *) _header;
+  long n = (long)( (_flags & Compressed)? h->csize() : h->size() );
+  tByte *block = (tByte *) 
+    allocate( allocatorOf( _header ), h->hsize() + n + 4 );
+  memcpy( block, h, h->hsize() );
+  if ( _data ) memcpy( block + h->hsize(), _data, n );
+  deallocate( _header );
+  _header = block;
+  h = (Header *) block;
+  if ( _flags & Compressed ) _data = 0;
+  else _data = (h->size() > 0)? block + h->hsize() : 0;
+  _flags &= ~View;
+}
+
+
+/**
+ *  The File::~File destructor releases all allocated data.
+ */
+
+File::~File() {
+  deallocate( _header );
+  deallocate( _name );
+  _header = _data = 0;
+  _name = 0;
+}
+
+
+/**
+ *  Files are allocated by the Allocator of the Stream reading them.
+ */
+
+void *File::operator new( size_t size, Allocator &allocator ) {
+  return allocate( &allocator, size );
+}
+
+void *File::operator new( size_t size ) {
+  return allocate( &Allocator::standard(), size );
+}
+
+void File::operator delete( void *ptr, Allocator &allocator ) {
+  deallocate( ptr );
+}
+
+void File::operator delete( void *ptr ) {
+  deallocate( ptr );
+}
+
+
+/**
+ *  File::size returns the file's size (uncompressed).
+ */
+
+long File::size( void ) const {
+  return (long) ((Header *)_header) -> size();
+}
+
+
+/**
+ *  The default implementation of StreamDelegate::handleFile prints the file 
+ *  name and some header data to stdout.
+ */
+
+void StreamDelegate::handleFile( File *file ) {
+  char buff[1024];
+  Header *h = (Header*)(file->header());
+  h -> toAscii( buff, 1024 );
+  printf( "%s: %s\n", file->name(), buff );
+  fflush( stdout );
+}
+
+
+/**
+ *  A Pipeline is a StreamDelegate passing compressed files to a pool of 
+ *  worker threads which decompress and check them in parallel and pass 
+ *  them to the Stream's delegate. The calls to the delegate are 
+ *  serialized, in ordered mode files are passed in archive order.
+ */
+
+class Pipeline : public StreamDelegate {
+
+  private:
+  StreamDelegate *_delegate;	// delegate to pass files to
+  int		 _ordered;	// pass files in archive order
+  int		 _maxPending;	// max #files in pipeline
+  std::vector<std::thread> _workers; // worker threads
+  std::mutex	 _mutex;	// protects the following data
+  std::condition_variable _work;  // signalled when a file has been queued
+  std::condition_variable _done;  // signalled when a file has been passed
+  std::deque< std::pair<long, File*> > _queue; // files to decompress
+  std::map<long, File*> _finished; // decompressed files out of order
+  long		 _seq;		// sequence number of next file queued
+  long		 _next;		// sequence number of next file to pass
+  long		 _pending;	// #files queued and not yet passed
+  int		 _stop;		// terminate worker threads
+  int		 _failed;	// an error has occurred
+  std::exception_ptr _error;	// first error
+  std::mutex	 _deliver;	// serializes calls to _delegate
+  std::map<long, std::pair<long, bool> > _ends; // end offset and passed flag
+                                // of files queued (by sequence number)
+  long		 _resume;	// offset after the files passed in order
+
+  public:
+  int		 mapped;	// the data scanned stays valid until 'wait'
+
+  private:
+
+  // decompresses queued files until _stop is set
+  void work( void );
+
+  // advances _resume over the files passed (_mutex must be locked)
+  void advance( void );
+
+  // passes a decompressed file (0 on error) to the delegate
+  void pass( long seq, File *file );
+
+  // records an error (_mutex must be locked)
+  void fail( std::exception_ptr e ) 
+    { if ( !_failed ) { _error = e; _failed = 1; } }
+
+  public:
+  Pipeline( StreamDelegate *delegate, int nthreads, int ordered );
+  ~Pipeline();
+
+  // waits until all files queued have been passed to the delegate
+  void wait( void );
+
+  // throws the first error occured in a worker thread
+  void check( void );
+
+  // sets the end offset of the file last found by zip::Stream
+  void ended( long end );
+
+  // returns the offset after the files passed and all files before them
+  long resumeOffset( void );
+
+  // StreamDelegate methods called by zip::Stream
+  void handleFile( File *file );
+  bool beginFile( File *file );
+  bool shouldAccept( File *file ) {
+    std::lock_guard<std::mutex> dlock( _deliver ); 
+    return _delegate -> shouldAccept( file );
+  }
+  void handleChunk( File *file, const void *data, size_t len )
+    { _delegate -> handleChunk( file, data, len ); }
+  void endFile( File *file, bool crcOk ) 
+    { _delegate -> endFile( file, crcOk ); }
+
+}; // class Pipeline
+
+Pipeline::Pipeline( StreamDelegate *delegate, int nthreads, int ordered ) {
+  _delegate = delegate;
+  _ordered = ordered;
+  _maxPending = 4 * nthreads;
+  _seq = _next = _pending = 0;
+  _stop = _failed = 0;
+  _resume = -1;
+  mapped = 0;
+  for ( int i = 0; i < nthreads; i++ )
+    _workers.push_back( std::thread( &Pipeline::work, this ) );
+}
+
+Pipeline::~Pipeline() {
+  wait();
+  { std::lock_guard<std::mutex> lock( _mutex ); _stop = 1; }
+  _work.notify_all();
+  for ( auto &t: _workers ) t.join();
+  for ( auto &f: _finished ) if ( f.second ) delete f.second;
+}
+
+void Pipeline::work( void ) {
+  std::unique_lock<std::mutex> lock( _mutex );
+  while ( true ) {
+    while ( _queue.empty() && !_stop ) _work.wait( lock );
+    if ( _queue.empty() ) return;
+    std::pair<long, File*> job = _queue.front();
+    _queue.pop_front();
+    lock.unlock();
+    try { job.second -> inflate(); }
+    catch ( ... ) {
+      delete job.second;
+      job.second = 0;
+      std::lock_guard<std::mutex> elock( _mutex );
+      fail( std::current_exception() );
+    }
+    pass( job.first, job.second );
+    lock.lock();
+} }
+
+void Pipeline::pass( long seq, File *file ) {
+  std::lock_guard<std::mutex> dlock( _deliver );
+  std::unique_lock<std::mutex> lock( _mutex );
+  _finished[seq] = file;
+  while ( !_finished.empty() ) {
+    auto first = _finished.begin();
+    if ( _ordered && (first->first != _next) ) break;
+    file = first->second;
+    seq = first->first;
+    _finished.erase( first );
+    _next++;
+    lock.unlock();
+    bool passed = false;
+    if ( file ) {
+      try { _delegate -> handleFile( file ); passed = true; }
+      catch ( ... ) { 
+        std::lock_guard<std::mutex> elock( _mutex ); 
+        fail( std::current_exception() ); 
+      }
+    }
+    lock.lock();
+    if ( passed ) { _ends[seq].second = true; advance(); }
+    _pending--;
+    _done.notify_all();
+} }
+
+void Pipeline::wait( void ) {
+  std::unique_lock<std::mutex> lock( _mutex );
+  while ( _pending > 0 ) _done.wait( lock );
+}
+
+void Pipeline::advance( void ) {
+  while ( !_ends.empty() ) {
+    auto first = _ends.begin();
+    if ( !first->second.second || (first->second.first < 0) ) break;
+    _resume = first->second.first;
+    _ends.erase( first );
+} }
+
+void Pipeline::ended( long end ) {
+  std::lock_guard<std::mutex> lock( _mutex );
+  // a file not queued (rejected or chunked) ends the last file queued
+  if ( _ends.empty() ) _resume = end;
+  else { _ends.rbegin()->second.first = end; advance(); }
+}
+
+long Pipeline::resumeOffset( void ) {
+  std::lock_guard<std::mutex> lock( _mutex );
+  return _resume;
+}
+
+void Pipeline::check( void ) {
+  std::lock_guard<std::mutex> lock( _mutex );
+  if ( _failed ) { 
+    std::exception_ptr e = _error;
+    _failed = 0; 
+    _error = nullptr;
+    std::rethrow_exception( e ); 
+} }
+
+void Pipeline::handleFile( File *file ) {
+  // the data buffer is gone when the file is passed unless it is mapped
+  if ( !mapped ) file -> keep();
+  std::unique_lock<std::mutex> lock( _mutex );
+  while ( _pending >= _maxPending ) _done.wait( lock );
+  _ends[_seq] = std::make_pair( -1L, false );
+  _queue.push_back( std::make_pair( _seq++, file ) );
+  _pending++;
+  _work.notify_one();
+}
+
+bool Pipeline::beginFile( File *file ) {
+  bool ret;
+  { std::lock_guard<std::mutex> dlock( _deliver ); 
+    ret = _delegate -> beginFile( file ); }
+  // chunks are passed by the scanning thread after all preceeding files
+  if ( ret ) wait();
+  return ret;
+}
+
+
+/**
+ *  A Receiver is a bounded ring of chunks of archive data passed from a 
+ *  receiving thread (the producer, see Stream::receive) to a scanning 
+ *  thread (the consumer) calling Stream::scan. The ring indices are 
+ *  atomic, so neither thread locks while the ring is neither empty nor 
+ *  full. Only then the waiting thread sleeps on a condition variable, 
+ *  it is woken by the other thread when it sees the waiting flag.
+ *  The storage of the chunks is kept and reused for the next chunks.
+ */
+
+class Receiver {
+
+  private:
+  struct Chunk {
+    char	*data;		// copy of the data received
+    long	 len;		// #bytes in data
+    long	 size;		// allocated size of data
+  };
+  Stream	*_stream;	// Stream to scan the chunks
+  Chunk		*_ring;		// chunks received
+  long		 _nchunks;	// #chunks in _ring
+  std::atomic<long> _head;	// #chunks scanned
+  std::atomic<long> _tail;	// #chunks received
+  std::atomic<int> _scannerWaits; // the scanner waits for a chunk
+  std::atomic<int> _receiverWaits; // the receiver waits for space
+  std::atomic<int> _failed;	// an error has occurred
+  int		 _stop;		// terminate the scanner thread
+  std::exception_ptr _error;	// first error
+  std::mutex	 _mutex;	// protects the sleeping and _error
+  std::condition_variable _received; // signalled when a chunk is added
+  std::condition_variable _scanned;  // signalled when a chunk is scanned
+  std::thread	 _scanner;	// scanning thread
+
+  // #times a thread yields before it sleeps waiting for the other one
+  static const int Spins = 64;
+
+  // scans chunks until _stop is set
+  void scan( void );
+
+  // waits until at most 'n' chunks are unscanned
+  void waitFor( long n );
+
+  public:
+  Receiver( Stream *stream, int nchunks );
+  ~Receiver();
+
+  // copies data to the ring, waits while the ring is full
+  void receive( const char *buff, long len );
+
+  // waits until all chunks received have been scanned
+  void wait( void ) { waitFor( 0 ); }
+
+  // throws the first error occured in the scanner thread
+  void check( void );
+
+}; // class Receiver
+
+Receiver::Receiver( Stream *stream, int nchunks ) 
+  : _head( 0 ), _tail( 0 ), _scannerWaits( 0 ), _receiverWaits( 0 ),
+    _failed( 0 ) {
+  _stream = stream;
+  _nchunks = (nchunks > 1)? nchunks : 2;
+  _ring = (Chunk *) calloc( _nchunks, sizeof(Chunk) );
+  if ( !_ring ) throw Exception();
+  _stop = 0;
+  _scanner = std::thread( &Receiver::scan, this );
+}
+
+Receiver::~Receiver() {
+  { std::lock_guard<std::mutex> lock( _mutex ); _stop = 1; }
+  _received.notify_one();
+  _scanner.join();
+  for ( long i = 0; i < _nchunks; i++ ) free( _ring[i].data );
+  free( _ring );
+}
+
+void Receiver::scan( void ) {
+  long head = _head.load( std::memory_order_relaxed );
+  while ( true ) {
+    for ( int i = 0; (i < Spins) && 
+          (_tail.load( std::memory_order_acquire ) == head); i++ )
+      std::this_thread::yield();
+    if ( _tail.load( std::memory_order_acquire ) == head ) {
+      std::unique_lock<std::mutex> lock( _mutex );
+      _scannerWaits = 1;
+      while ( (_tail.load() == head) && !_stop ) _received.wait( lock );
+      _scannerWaits = 0;
+      if ( _stop ) return;
+    }
+    Chunk *c = _ring + (head % _nchunks);
+    // after an error the data is dropped
+    if ( !_failed.load( std::memory_order_relaxed ) ) {
+      try { _stream -> scan( c->data, c->len ); }
+      catch ( ... ) {
+        std::lock_guard<std::mutex> lock( _mutex );
+        _error = std::current_exception();
+        _failed = 1;
+    } }
+    _head.store( ++head );
+    if ( _receiverWaits.load() ) 
+      { std::lock_guard<std::mutex> lock( _mutex ); _scanned.notify_one(); }
+} }
+
+void Receiver::waitFor( long n ) {
+  long tail = _tail.load( std::memory_order_relaxed );
+  for ( int i = 0; i < Spins; i++ ) {
+    if ( tail - _head.load( std::memory_order_acquire ) <= n ) return;
+    std::this_thread::yield();
+  }
+  std::unique_lock<std::mutex> lock( _mutex );
+  _receiverWaits = 1;
+  while ( tail - _head.load() > n ) _scanned.wait( lock );
+  _receiverWaits = 0;
+}
+
+void Receiver::receive( const char *buff, long len ) {
+  check();
+  if ( len <= 0 ) return;
+  waitFor( _nchunks - 1 );
+  long tail = _tail.load( std::memory_order_relaxed );
+  Chunk *c = _ring + (tail % _nchunks);
+  if ( c->size < len ) {
+    char *data = (char *) realloc( c->data, len );
+    if ( !data ) throw Exception();
+    c->data = data;
+    c->size = len;
+  }
+  memcpy( c->data, buff, len );
+  c->len = len;
+  _tail.store( tail + 1 );
+  if ( _scannerWaits.load() ) 
+    { std::lock_guard<std::mutex> lock( _mutex ); _received.notify_one(); }
+}
+
+void Receiver::check( void ) {
+  if ( _failed.load() ) {
+    std::lock_guard<std::mutex> lock( _mutex );
+    if ( _failed ) { 
+      std::exception_ptr e = _error;
+      _failed = 0; 
+      _error = nullptr;
+      std::rethrow_exception( e ); 
+    }
+} }
+
+
+/**
+ *  The Stream constructor allocates a Buffer object to store the read data,
+ *  Files and their contents are allocated by 'allocator'.
+ */
+
+Stream::Stream( StreamDelegate &delegate, Allocator &allocator ) {
+  _delegate = &delegate;
+  _buffer = new Buffer( _delegate, &allocator );
+  _pipeline = _receiver = _map = 0;
+  _mapsize = 0;
+  _bytes_read = _offset = _resume = 0;
+}
+
+
+/**
+ *  The Stream destructor releases all allocated structures.
+ */
+
+Stream::~Stream() {
+  Buffer *b = (Buffer *) _buffer;
+  Pipeline *p = (Pipeline *) _pipeline;
+  if ( _receiver ) delete (Receiver *) _receiver;
+  if ( p ) delete p;
+  _delegate = 0;
+  if ( b ) delete b;
+  if ( _map ) munmap( _map, _mapsize );
+  _buffer = _pipeline = _receiver = _map = 0;
+}
+
+
+/**
+ *  Stream::setThreads defines the number of threads used to decompress
+ *  files. If nthreads > 1, Stream::scan only frames the compressed files 
+ *  and passes them to a pool of nthreads worker threads. The decompressed 
+ *  files are passed to the delegate from the worker threads (in archive 
+ *  order if 'ordered' is true). The calls to the delegate are serialized.
+ *  Stream::finish must be called to wait for the last files.
+ */
+
+void Stream::setThreads( int nthreads, bool ordered ) {
+  Buffer *b = (Buffer *) _buffer;
+  Pipeline *p = (Pipeline *) _pipeline;
+  if ( p ) { 
+    p -> wait();
+    _resume = resumeOffset();
+    delete p; 
+    _pipeline = 0; 
+  }
+  if ( nthreads > 1 ) {
+    _pipeline = new Pipeline( _delegate, nthreads, ordered );
+    b->_delegate = (Pipeline *) _pipeline;
+    b->_defer = 1;
+  }
+  else { b->_delegate = _delegate; b->_defer = b->_lazy; }
+}
+
+
+/**
+ *  Stream::setLazy defines whether compressed files should be passed to the
+ *  delegate without being decompressed. File::data (or File::inflate) 
+ *  decompresses such a file (File::isCompressed) and checks its CRC32, 
+ *  this may be done in any thread. If threads are used (see setThreads) 
+ *  files are always decompressed by the worker threads.
+ */
+
+void Stream::setLazy( bool lazy ) {
+  Buffer *b = (Buffer *) _buffer;
+  b->_lazy = lazy;
+  if ( !_pipeline ) b->_defer = lazy;
+}
+
+
+/**
+ *  Stream::setZeroCopy defines whether the contents of stored (uncompressed)
+ *  files should be referenced in the data passed to Stream::scan instead of
+ *  being copied. This is possible if a file is completely contained in 
+ *  the data passed. Such a file (File::isView) is only valid during
+ *  StreamDelegate::handleFile unless File::keep is called.
+ */
+
+void Stream::setZeroCopy( bool zerocopy ) {
+  ((Buffer *) _buffer) -> _zerocopy = zerocopy;
+}
+
+
+/**
+ *  Stream::stats returns the counters of the Stream, they should be read
+ *  between calls to Stream::scan.
+ */
+
+const StreamStats &Stream::stats( void ) const {
+  return ((Buffer *) _buffer) -> _stats;
+}
+
+
+/**
+ *  Stream::finish waits until all files found have been passed to the 
+ *  delegate and throws an Exception if a worker thread failed.
+ */
+
+void Stream::finish( void ) {
+  Receiver *r = (Receiver *) _receiver;
+  Pipeline *p = (Pipeline *) _pipeline;
+  if ( r ) { r->wait(); r->check(); }
+  if ( p ) { p->wait(); p->check(); }
+}
+
+
+/**
+ *  Stream::setReceiving starts a scanning thread calling Stream::scan 
+ *  with the data passed to Stream::receive. Up to 'nchunks' pieces of data
+ *  received are queued, if more are received Stream::receive waits. 
+ *  Hence the receiving thread doesn't wait for decompression unless 
+ *  the scanning thread falls behind. The delegate is called by the 
+ *  scanning thread (or by the worker threads, see setThreads).
+ *  setReceiving( 0 ) stops the scanning thread after the data received
+ *  has been scanned. Other Stream methods (except receive and finish)
+ *  must not be called while the scanning thread is running.
+ */
+
+void Stream::setReceiving( int nchunks ) {
+  Receiver *r = (Receiver *) _receiver;
+  if ( r ) { r->wait(); delete r; _receiver = 0; }
+  if ( nchunks > 0 ) _receiver = new Receiver( this, nchunks );
+}
+
+
+/**
+ *  Stream::receive copies the data to the queue of the scanning thread
+ *  (see setReceiving) and returns, it waits only if the queue is full.
+ *  Errors found by the scanning thread are thrown by the following call
+ *  to receive or by Stream::finish. Without scanning thread the data
+ *  is scanned at once.
+ */
+
+void Stream::receive( const char *buff, long bufflen ) {
+  if ( _receiver ) ((Receiver *) _receiver) -> receive( buff, bufflen );
+  else scan( buff, bufflen );
+}
+
+
+/**
+ *  Stream::scan scans the given data for a zip file in a zip archive. If
+ *  a complete file could be found, the File is passed to the StreamDelegate.
+ */
+
+void Stream::scan( const char *buff, long blen ) {
+  Buffer *b = (Buffer *) _buffer;
+  long bufflen = blen;
+  if ( _pipeline ) ((Pipeline *) _pipeline) -> check();
+  while ( bufflen > 0 ) {
+    b->addData( &buff, &bufflen );
+    _bytes_read += (blen - bufflen);
+    blen = bufflen;
+    if ( b->fileFound() ) {
+      File *f = b->file();
+      if ( b->isRejected() ) delete f;
+      else if ( b->isChunked() ) {
+        try { b->_delegate -> endFile( f, b->isValid() ); }
+        catch ( ... ) { delete f; throw; }
+        delete f;
+      }
+      else b->_delegate -> handleFile( f );
+      b->reset();
+      // the file ends at the current position
+      if ( _pipeline ) ((Pipeline *) _pipeline) -> ended( _offset + _bytes_read );
+      else _resume = _offset + _bytes_read;
+} } }
+
+
+/**
+ *  Stream::scanMapped scans data like Stream::scan, but the data must stay 
+ *  valid until Stream::finish has returned and while Files referencing it 
+ *  are used (e.g. a mapped file). Then stored files and compressed files 
+ *  not decompressed by Stream::scan (see setThreads and setLazy) refer to
+ *  their data in place (File::isView) if they are completely contained 
+ *  in the data passed. File::keep copies the data referenced.
+ */
+
+void Stream::scanMapped( const void *data, long len ) {
+  Buffer *b = (Buffer *) _buffer;
+  Pipeline *p = (Pipeline *) _pipeline;
+  b->_mapped = 1;
+  if ( p ) p->mapped = 1;
+  try { scan( (const char *) data, len ); }
+  catch ( ... ) { b->_mapped = 0; if ( p ) p->mapped = 0; throw; }
+  b->_mapped = 0;
+  if ( p ) p->mapped = 0;
+}
+
+
+/**
+ *  Stream::scanFile maps the zip archive at 'path' and scans it using
+ *  Stream::scanMapped. The mapping is kept until the Stream is destroyed,
+ *  so Files referencing it are valid as long as the Stream. scanFile
+ *  returns when all files have been passed to the delegate.
+ */
+
+void Stream::scanFile( const char *path ) {
+  struct stat st;
+  int fd = open( path, O_RDONLY );
+  if ( fd < 0 ) throw Exception( "zip archive not readable" );
+  if ( fstat( fd, &st ) != 0 ) 
+    { close( fd ); throw Exception( "zip archive not readable" ); }
+  if ( _map ) { finish(); munmap( _map, _mapsize ); _map = 0; }
+  if ( st.st_size > 0 ) {
+    _mapsize = (long) st.st_size;
+    _map = mmap( 0, _mapsize, PROT_READ, MAP_SHARED, fd, 0 );
+    if ( _map == MAP_FAILED ) _map = 0;
+  }
+  close( fd );
+  if ( !_map ) {
+    if ( st.st_size == 0 ) return;
+    throw Exception( "zip archive can't be mapped" ); 
+  }
+  posix_madvise( _map, _mapsize, POSIX_MADV_SEQUENTIAL );
+  scanMapped( _map, _mapsize );
+  finish();
+}
+
+
+/**
+ *  Stream::setOffset defines the offset in the zip archive of the first 
+ *  byte passed to Stream::scan. This is used to resume scanning at the 
+ *  position returned by Stream::resumeOffset of an interrupted Stream. 
+ *  setOffset must be called before Stream::scan.
+ */
+
+void Stream::setOffset( long offset ) {
+  if ( _bytes_read > 0 ) throw Exception( "zip stream already scanning" );
+  _offset = _resume = offset;
+}
+
+
+/**
+ *  Stream::resumeOffset returns the offset in the zip archive following 
+ *  the last file passed to the delegate (and all files preceeding it).
+ *  Scanning may be resumed at this offset (see Stream::setOffset) without
+ *  passing any file again.
+ */
+
+long Stream::resumeOffset( void ) const {
+  if ( _pipeline ) {
+    long ret = ((Pipeline *) _pipeline) -> resumeOffset();
+    if ( ret >= 0 ) return ret;
+  }
+  return _resume;
+}
+
+
+
+/**
+ *  An Index is the table of contents of a zip::Archive. It refers to the
+ *  central directory in the mapped archive and uses a hash table to find
+ *  files by name.
+ */
+
+class Index {
+
+  public:
+  struct Entry {
+    const CentralHeader *central;	// central file header
+    const char	*name;		// zero terminated file name
+    unsigned	 hash;		// hash value of name
+  };
+  Entry		*_entries;	// one entry per file
+  int		 _count;	// #entries
+  char		*_names;	// storage of zero terminated file names
+  int		*_table;	// hash table of entry indices (-1: free)
+  unsigned	 _tsize;	// size of hash table (power of 2)
+
+  // FNV-1a hash of a file name
+  static unsigned hash( const char *name ) {
+    unsigned h = 2166136261u;
+    while ( *name ) h = (h ^ (tByte) *name++) * 16777619u;
+    return h;
+  }
+
+  Index( const tByte *map, long mapsize );
+  ~Index() { release(); }
+
+  // releases all allocated data
+  void release( void );
+
+  // returns the index of the named file or -1
+  int find( const char *name ) const;
+
+}; // class Index
+
+Index::Index( const tByte *map, long mapsize ) {
+  const EndOfCentralDirectory *eocd = 0;
+  long pos, minpos = mapsize - sizeof(EndOfCentralDirectory) - 0xffff;
+  _entries = 0; _names = 0; _table = 0; _count = 0;
+  // search end of central directory record (followed by a comment)
+  for ( pos = mapsize - sizeof(EndOfCentralDirectory); 
+        (pos >= 0) && (pos >= minpos); pos-- ) {
+    if ( memcmp( map + pos, EndOfCentralDirectory::signature, 4 ) == 0 ) 
+      { eocd = (const EndOfCentralDirectory *)( map + pos ); break; }
+  }
+  if ( !eocd ) throw Exception( "zip archive corrupt (no central directory)" );
+  uint64_t nentries = eocd->nentries(), cdsize = eocd->cdsize(),
+           cdoffset = eocd->cdoffset();
+  if ( eocd->isZip64() && (pos >= (long) sizeof(Zip64Locator)) &&
+       !memcmp( map + pos - sizeof(Zip64Locator), Zip64Locator::signature, 4 ) ) {
+    // the central directory is described by the Zip64 record
+    const Zip64Locator *loc = 
+      (const Zip64Locator *)( map + pos - sizeof(Zip64Locator) );
+    uint64_t rpos = loc->offset();
+    if ( (rpos > (uint64_t) pos) || 
+         ((uint64_t) pos - rpos < sizeof(Zip64EndOfCentralDirectory)) ||
+         memcmp( map + rpos, Zip64EndOfCentralDirectory::signature, 4 ) )
+      throw Exception( "zip archive corrupt (zip64 central directory)" );
+    const Zip64EndOfCentralDirectory *eocd64 = 
+      (const Zip64EndOfCentralDirectory *)( map + rpos );
+    nentries = eocd64->nentries();
+    cdsize = eocd64->cdsize();
+    cdoffset = eocd64->cdoffset();
+    pos = (long) rpos;
+  }
+  if ( (cdoffset > (uint64_t) pos) || (cdsize > (uint64_t) pos - cdoffset) || 
+       (nentries > cdsize) ) 
+    throw Exception( "zip archive corrupt (central directory)" );
+  long offset = (long) cdoffset, end = offset + (long) cdsize;
+  _count = (int) nentries;
+  _entries = (Entry *) malloc( (_count+1) * sizeof(Entry) );
+  _names = (char *) malloc( cdsize + 1 );
+  for ( _tsize = 16; _tsize < 2*(unsigned)_count; _tsize *= 2 );
+  _table = (int *) malloc( _tsize * sizeof(int) );
+  if ( !_entries || !_names || !_table ) { release(); throw Exception(); }
+  memset( _table, -1, _tsize * sizeof(int) );
+  char *names = _names;
+  for ( int i = 0; i < _count; i++ ) {
+    const CentralHeader *ch = (const CentralHeader *)( map + offset );
+    if ( (offset + (long) sizeof(CentralHeader) > end) ||
+         memcmp( ch, CentralHeader::signature, 4 ) ||
+         (offset + ch->hsize() > end) ) {
+      release();
+      throw Exception( "zip archive corrupt (central directory)" );
+    }
+    Entry *e = _entries + i;
+    e->central = ch;
+    e->name = names;
+    memcpy( names, ch->name(), ch->fnlength() );
+    names += ch->fnlength();
+    *names++ = '\0';
+    e->hash = hash( e->name );
+    unsigned slot = e->hash & (_tsize - 1);
+    while ( _table[slot] >= 0 ) slot = (slot + 1) & (_tsize - 1);
+    _table[slot] = i;
+    offset += ch->hsize();
+} }
+
+void Index::release( void ) {
+  if ( _entries ) free( _entries );
+  if ( _names ) free( _names );
+  if ( _table ) free( _table );
+  _entries = 0; _names = 0; _table = 0;
+}
+
+int Index::find( const char *name ) const {
+  unsigned h = hash( name );
+  for ( unsigned slot = h & (_tsize - 1); _table[slot] >= 0; 
+        slot = (slot + 1) & (_tsize - 1) ) {
+    const Entry *e = _entries + _table[slot];
+    if ( (e->hash == h) && (strcmp( e->name, name ) == 0) ) 
+      return _table[slot];
+  }
+  return -1;
+}
+
+
+/**
+ *  The Archive constructor maps the zip archive at 'path' into memory and
+ *  reads its central directory.
+ */
+
+Archive::Archive( const char *path ) {
+  struct stat st;
+  int fd = open( path, O_RDONLY );
+  _map = 0;
+  _index = 0;
+  if ( fd < 0 ) throw Exception( "zip archive not readable" );
+  if ( (fstat( fd, &st ) != 0) || 
+       (st.st_size < (off_t) sizeof(EndOfCentralDirectory)) ) {
+    close( fd );
+    throw Exception( "zip archive corrupt (no central directory)" );
+  }
+  _mapsize = (long) st.st_size;
+  _map = mmap( 0, _mapsize, PROT_READ, MAP_SHARED, fd, 0 );
+  close( fd );
+  if ( _map == MAP_FAILED ) 
+    { _map = 0; throw Exception( "zip archive can't be mapped" ); }
+  try { _index = new Index( (const tByte *) _map, _mapsize ); }
+  catch ( ... ) { munmap( _map, _mapsize ); _map = 0; throw; }
+}
+
+
+/**
+ *  The Archive destructor unmaps the zip archive.
+ */
+
+Archive::~Archive() {
+  if ( _index ) delete (Index *) _index;
+  if ( _map ) munmap( _map, _mapsize );
+  _index = _map = 0;
+}
+
+
+/**
+ *  Archive::count returns the number of files in the archive.
+ */
+
+int Archive::count( void ) const {
+  return ((Index *) _index) -> _count;
+}
+
+
+/**
+ *  Archive::name returns the name of the i'th file in the archive.
+ */
+
+const char *Archive::name( int i ) const {
+  Index *x = (Index *) _index;
+  return ( (i >= 0) && (i < x->_count) )? x->_entries[i].name : 0;
+}
+
+
+/**
+ *  Archive::find returns the index of the named file or -1 if the file
+ *  is not in the archive.
+ */
+
+int Archive::find( const char *name ) const {
+  return ((Index *) _index) -> find( name );
+}
+
+
+/**
+ *  Archive::extract decompresses the i'th file in the archive. The 
+ *  returned File must be deleted after use.
+ */
+
+File *Archive::extract( int i ) const {
+  Index *x = (Index *) _index;
+  if ( (i < 0) || (i >= x->_count) ) return 0;
+  const CentralHeader *ch = x->_entries[i].central;
+  const tByte *map = (const tByte *) _map;
+  uint64_t offset = ch->offset();
+  const Header *h = (const Header *)( map + offset );
+  // sizes are compared without additions which might overflow
+  uint64_t left = (uint64_t) _mapsize;
+  if ( (offset > left) || (left - offset < sizeof(Header)) || 
+       memcmp( h, Header::signature, 4 ) || 
+       (left - offset < h->hsize()) ||
+       (ch->csize() > left - offset - h->hsize()) )
+    throw Exception( "zip archive corrupt (local header)" );
+  if ( ch->size() >= ((uint64_t) 1 << 62) )
+    throw Exception( "zip archive corrupt (size error)" );
+  Allocator *a = &Allocator::standard();
+  tByte *block = (tByte *) allocate( a, h->hsize() + ch->size() + 4 );
+  memcpy( block, h, h->hsize() );
+  Header *nh = (Header *) block;
+  nh -> setDataDescriptor( ch );
+  File *f = 0;
+  try {
+    decompress( nh, map + offset + h->hsize(), block + nh->hsize() );
+    f = new File;
+    f->_name = (char *) allocate( a, strlen( x->_entries[i].name ) + 1 );
+  }
+  catch ( ... ) { deallocate( block ); if ( f ) delete f; throw; }
+  strcpy( f->_name, x->_entries[i].name );
+  f->_header = block;
+  f->_data = (nh->size() > 0)? block + nh->hsize() : 0;
+  return f;
+}
+
+
+/**
+ *  Archive::extract decompresses the named file. The returned File must
+ *  be deleted after use, 0 is returned if there is no such file.
+ */
+
+File *Archive::extract( const char *name ) const {
+  return extract( find( name ) );
+}
+
+
+/**
+ *  makeDirs creates the directory 'path' and missing parent directories.
+ *  Directories existing already (e.g. created by another thread at the 
+ *  same time) are no error. 'path' is modified temporarily.
+ */
+
+static int makeDirs( char *path ) {
+  if ( !*path ) return -1;
+  for ( char *p = path + 1; ; p++ ) {
+    if ( (*p == '/') || !*p ) {
+      char c = *p;
+      *p = 0;
+      int err = mkdir( path, 0777 )? errno : 0;
+      *p = c;
+      if ( err && (err != EEXIST) ) return -1;
+      if ( !c ) break;
   } }
-  return ret;
+  struct stat st;
+  if ( stat( path, &st ) || !S_ISDIR( st.st_mode ) ) return -1;
+  return 0;
+}
+
+/**
+ *  createFile creates the file of the File 'f' in directory 'dir' using the
+ *  file's name as relative path and returns its descriptor. Missing 
+ *  directories are created, file names ending with '/' denote directories
+ *  (-1 is returned). Names pointing outside of 'dir' are rejected. 
+ *  The path name is written to 'path' ('len' bytes).
+ */
+
+static int createFile( const char *dir, File *f, char *path, int len ) {
+  const char *name = f->name();
+  for ( const char *p = name; *p; ) {
+    if ( (p[0] == '.') && (p[1] == '.') && (!p[2] || (p[2] == '/')) )
+      throw Exception( "zip archive corrupt (invalid file name)" );
+    while ( *p && (*p != '/') ) p++;
+    while ( *p == '/' ) p++;
+  }
+  if ( fn_mkpathname( path, len, dir, name ) >= len - 1 )
+    throw Exception( "zip archive corrupt (file name too long)" );
+  if ( name[0] && (name[strlen( name ) - 1] == '/') ) {
+    // the directory is created (and its path returned) without '/'
+    size_t l = strlen( path );
+    while ( (l > 1) && (path[l-1] == '/') ) path[--l] = 0;
+    if ( makeDirs( path ) ) throw Exception( "can't create directory" );
+    return -1;
+  }
+  char *slash = strrchr( path, '/' );
+  if ( slash && (slash != path) ) {
+    *slash = 0;
+    int ret = makeDirs( path );
+    *slash = '/';
+    if ( ret ) throw Exception( "can't create directory" );
+  }
+  int fd = open( path, O_WRONLY | O_CREAT | O_TRUNC, 0666 );
+  if ( fd < 0 ) throw Exception( "can't create file" );
+  return fd;
+}
+
+/**
+ *  preallocate reserves disk space for the contents of File 'f' written
+ *  to 'fd', so the file system may place the file contiguously. Errors 
+ *  are ignored. The size is read from the header and is checked only 
+ *  after the file has been written, so nothing is reserved if it exceeds 
+ *  what the compressed size may expand to (deflate expands at most 1032:1).
+ */
+
+static void preallocate( int fd, File *f ) {
+  static const uint64_t MaxRatio = 1032;
+  long size = f->size();
+  if ( (size <= 0) || 
+       ((uint64_t) size / MaxRatio > ((Header *) f->header())->csize()) ) 
+    return;
+#if defined(__linux__)
+  // the file size is only extended by writing
+  fallocate( fd, FALLOC_FL_KEEP_SIZE, 0, size );
+#elif defined(F_PREALLOCATE)
+  fstore_t st = { F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, size, 0 };
+  if ( fcntl( fd, F_PREALLOCATE, &st ) < 0 ) {
+    st.fst_flags = F_ALLOCATEALL;
+    fcntl( fd, F_PREALLOCATE, &st );
+  }
+#endif
+}
+
+/**
+ *  writeBytes writes 'len' bytes to file 'fd'.
+ */
+
+static void writeBytes( int fd, const void *data, size_t len ) {
+  const char *ptr = (const char *) data;
+  while ( len > 0 ) {
+    ssize_t n = write( fd, ptr, len );
+    if ( n <= 0 ) throw Exception( "can't write file" );
+    ptr += n;
+    len -= n;
+} }
+
+/**
+ *  closeFile sets the modification time of file 'fd' to that of the File
+ *  'f' and closes it.
+ */
+
+static void closeFile( int fd, File *f ) {
+  struct timespec times[2];
+  times[0].tv_sec = times[1].tv_sec = ((Header *) f->header()) -> mtime();
+  times[0].tv_nsec = times[1].tv_nsec = 0;
+  futimens( fd, times );
+  if ( close( fd ) ) throw Exception( "can't write file" );
+}
+
+/**
+ *  writeFile writes the File 'f' to directory 'dir' (see createFile).
+ */
+
+static void writeFile( const char *dir, File *f ) {
+  char path[1024];
+  int fd = createFile( dir, f, path, sizeof path );
+  if ( fd < 0 ) return;
+  try { 
+    preallocate( fd, f );
+    writeBytes( fd, f->data(), f->size() ); 
+  }
+  catch ( ... ) { close( fd ); throw; }
+  closeFile( fd, f );
+}
+
+
+/**
+ *  Archive::extractAll writes all files of the archive to directory 'dir'.
+ *  The files are decompressed in parallel by 'nthreads' threads (#cores
+ *  if nthreads <= 0), largest files first. The first error encountered
+ *  is thrown after all threads have terminated.
+ */
+
+void Archive::extractAll( const char *dir, int nthreads ) const {
+  Index *x = (Index *) _index;
+  std::vector<int> order( x->_count );
+  std::atomic<int> next( 0 );
+  std::mutex mutex;
+  std::exception_ptr error;
+  for ( int i = 0; i < x->_count; i++ ) order[i] = i;
+  std::sort( order.begin(), order.end(), [x]( int a, int b ) 
+    { return x->_entries[a].central->csize() > x->_entries[b].central->csize(); } );
+  auto work = [&]() {
+    int i;
+    while ( (i = next++) < x->_count ) {
+      File *f = 0;
+      try { f = extract( order[i] ); writeFile( dir, f ); }
+      catch ( ... ) {
+        std::lock_guard<std::mutex> lock( mutex );
+        if ( !error ) error = std::current_exception();
+        next = x->_count;
+      }
+      if ( f ) delete f;
+  } };
+  if ( nthreads <= 0 ) nthreads = (int) std::thread::hardware_concurrency();
+  if ( nthreads > x->_count ) nthreads = x->_count;
+  std::vector<std::thread> workers;
+  for ( int i = 1; i < nthreads; i++ ) workers.push_back( std::thread( work ) );
+  work();
+  for ( auto &t: workers ) t.join();
+  if ( error ) std::rethrow_exception( error );
+}
+
+
+/**
+ *  A Readahead reads the blocks of a file into buffers asynchronously: 
+ *  'start' requests a block, 'wait' waits until it has been read.
+ */
+
+class Readahead {
+
+  public:
+  // a buffer and the block read into it
+  struct Block {
+    tByte	*data;		// buffer (aligned)
+    long	 block;		// block number (-1: unused)
+    long	 len;		// #bytes read
+    long	 want;		// #bytes to read
+    int		 done;		// block read (or failed)
+    int		 error;		// errno of failed read
+  };
+
+  protected:
+  int		 _fd;		// file to read
+  long		 _bsize;	// block size
+  int		 _nbuffers;	// #buffers
+  Block		*_blocks;	// buffers
+
+  // Block of block number 'n'
+  Block *blockOf( long n ) const { return _blocks + (n % _nbuffers); }
+
+  public:
+  Readahead( int fd, long bsize, int nbuffers, Block *blocks ) 
+    { _fd = fd; _bsize = bsize; _nbuffers = nbuffers; _blocks = blocks; }
+  virtual ~Readahead() {}
+
+  // starts reading 'want' bytes of block 'n'
+  virtual void start( long n, long want ) = 0;
+
+  // waits until block 'n' has been read, returns its Block
+  virtual Block *wait( long n ) = 0;
+
+}; // class Readahead
+
+
+/**
+ *  A ThreadReadahead reads the blocks requested in a separate thread.
+ */
+
+class ThreadReadahead : public Readahead {
+
+  private:
+  std::thread	 _thread;	// reading thread
+  std::mutex	 _mutex;	// protects the following
+  std::condition_variable _requested; // signalled when a block is requested
+  std::condition_variable _read;  // signalled when a block has been read
+  std::deque<long> _queue;	// blocks requested
+  int		 _stop;		// terminate the reading thread
+
+  // reads the blocks requested until _stop is set
+  void work( void );
+
+  public:
+  ThreadReadahead( int fd, long bsize, int nbuffers, Block *blocks );
+  ~ThreadReadahead();
+  void start( long n, long want );
+  Block *wait( long n );
+
+}; // class ThreadReadahead
+
+ThreadReadahead::ThreadReadahead( int fd, long bsize, int nbuffers, 
+                                  Block *blocks ) 
+  : Readahead( fd, bsize, nbuffers, blocks ) {
+  _stop = 0;
+  _thread = std::thread( &ThreadReadahead::work, this );
+}
+
+ThreadReadahead::~ThreadReadahead() {
+  { std::lock_guard<std::mutex> lock( _mutex ); _stop = 1; }
+  _requested.notify_one();
+  _thread.join();
+}
+
+void ThreadReadahead::work( void ) {
+  std::unique_lock<std::mutex> lock( _mutex );
+  while ( true ) {
+    while ( _queue.empty() && !_stop ) _requested.wait( lock );
+    if ( _stop ) return;
+    long n = _queue.front();
+    _queue.pop_front();
+    Block *b = blockOf( n );
+    lock.unlock();
+    long len = 0;
+    int error = 0;
+    while ( len < b->want ) {
+      ssize_t r = pread( _fd, b->data + len, b->want - len, 
+                         (off_t) n * _bsize + len );
+      if ( r > 0 ) len += r;
+      else if ( (r < 0) && (errno == EINTR) ) continue;
+      else { error = (r < 0)? errno : EIO; break; }
+    }
+    lock.lock();
+    b->len = len;
+    b->error = error;
+    b->done = 1;
+    _read.notify_one();
+} }
+
+void ThreadReadahead::start( long n, long want ) {
+  Block *b = blockOf( n );
+  std::lock_guard<std::mutex> lock( _mutex );
+  b->block = n; b->want = want; b->len = 0; b->done = b->error = 0;
+  _queue.push_back( n );
+  _requested.notify_one();
+}
+
+Readahead::Block *ThreadReadahead::wait( long n ) {
+  Block *b = blockOf( n );
+  std::unique_lock<std::mutex> lock( _mutex );
+  while ( !b->done ) _read.wait( lock );
+  return b;
 }
 
+#if defined(ZIP_URING)
 
 /**
- *  Header::toAscii writes an ascii representation of a zip Header to 
- *  the given buffer.
+ *  An UringReadahead keeps the reads of all buffers in flight using 
+ *  io_uring (Linux 5.1 or later). The rings are used directly via the 
+ *  system calls io_uring_setup and io_uring_enter (no liburing needed).
  */
 
-int Header::toAscii( char *buff, int olen ) {
-  const char *compr = "";
-  int len = olen;
-  switch ( compression() ) {
-    case Stored:	compr = "Stored"; break;
-    case Shrunk:	compr = "Shrunk"; break;
-    case Reduced1:	compr = "Reduced1"; break;
-    case Reduced2:	compr = "Reduced2"; break;
-    case Reduced3:	compr = "Reduced3"; break;
-    case Reduced4:	compr = "Reduced4"; break;
-    case Imploded:	compr = "Imploded"; break;
-    case Deflated:	compr = "Deflated"; break;
-    case Deflated64:	compr = "Deflated64"; break;
-    case LibImploded:	compr = "LibImploded"; break;
-    case Bzip2:		compr = "Bzip2"; break;
-    case Lzma:		compr = "Lzma"; break;
-    case IbmTerse:	compr = "IbmTerse"; break;
-    case Lz77:		compr = "Lz77"; break;
-    case WavPack:	compr = "WavPack"; break;
-    case PPMd:		compr = "PPMd"; break;
-  }
-  int l = snprintf( buff, len, "%s", compr );
-  buff += l; len -= l;
-  if ( flags() & Encrypted ) {
-    l = snprintf( buff, len, ", encrypted" );
-    buff += l; len -= l;
+class UringReadahead : public Readahead {
+
+  private:
+  int		 _ring;		// io_uring file descriptor
+  void		*_sq, *_cq;	// mapped submission and completion rings
+  size_t	 _sqsize, _cqsize; // sizes of _sq and _cq
+  struct io_uring_sqe *_sqes;	// submission queue entries
+  size_t	 _sqessize;	// size of _sqes
+  unsigned	*_sqhead, *_sqtail, *_sqmask, *_sqarray;
+  unsigned	*_cqhead, *_cqtail, *_cqmask;
+  struct io_uring_cqe *_cqes;	// completion queue entries
+  struct iovec	*_iov;		// iovec of each buffer
+
+  // submits a read of the rest of Block 'b'
+  void submit( Block *b );
+
+  // waits for a completion and processes it
+  void reap( void );
+
+  // releases the rings
+  void release( void );
+
+  public:
+  UringReadahead( int fd, long bsize, int nbuffers, Block *blocks );
+  ~UringReadahead();
+  void start( long n, long want );
+  Block *wait( long n );
+
+  // is io_uring available?
+  int isValid( void ) const { return _ring >= 0; }
+
+}; // class UringReadahead
+
+UringReadahead::UringReadahead( int fd, long bsize, int nbuffers, 
+                                Block *blocks ) 
+  : Readahead( fd, bsize, nbuffers, blocks ) {
+  struct io_uring_params p;
+  memset( &p, 0, sizeof p );
+  _sq = _cq = _sqes = 0;
+  _iov = 0;
+  if ( (_ring = (int) syscall( __NR_io_uring_setup, nbuffers, &p )) < 0 ) 
+    return;
+  _sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  _cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if ( p.features & IORING_FEAT_SINGLE_MMAP ) 
+    _sqsize = _cqsize = std::max( _sqsize, _cqsize );
+  _sqessize = p.sq_entries * sizeof(struct io_uring_sqe);
+  _sq = mmap( 0, _sqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              _ring, IORING_OFF_SQ_RING );
+  if ( _sq == MAP_FAILED ) _sq = 0;
+  else if ( p.features & IORING_FEAT_SINGLE_MMAP ) _cq = _sq;
+  else if ( (_cq = mmap( 0, _cqsize, PROT_READ | PROT_WRITE, 
+                         MAP_SHARED | MAP_POPULATE, _ring, 
+                         IORING_OFF_CQ_RING )) == MAP_FAILED ) _cq = 0;
+  if ( _cq ) {
+    _sqes = (struct io_uring_sqe *) mmap( 0, _sqessize, 
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring, 
+      IORING_OFF_SQES );
+    if ( _sqes == MAP_FAILED ) _sqes = 0;
   }
-  if ( flags() & Utf8Encoded ) {
-    l = snprintf( buff, len, ", utf8" );
-    buff += l; len -= l;
+  _iov = (struct iovec *) calloc( nbuffers, sizeof(struct iovec) );
+  if ( !_sqes || !_iov ) { release(); return; }
+  tByte *sq = (tByte *) _sq, *cq = (tByte *) _cq;
+  _sqhead = (unsigned *)( sq + p.sq_off.head );
+  _sqtail = (unsigned *)( sq + p.sq_off.tail );
+  _sqmask = (unsigned *)( sq + p.sq_off.ring_mask );
+  _sqarray = (unsigned *)( sq + p.sq_off.array );
+  _cqhead = (unsigned *)( cq + p.cq_off.head );
+  _cqtail = (unsigned *)( cq + p.cq_off.tail );
+  _cqmask = (unsigned *)( cq + p.cq_off.ring_mask );
+  _cqes = (struct io_uring_cqe *)( cq + p.cq_off.cqes );
+}
+
+UringReadahead::~UringReadahead() {
+  // reads in flight must complete before their buffers are released
+  if ( isValid() ) {
+    for ( int i = 0; i < _nbuffers; i++ )
+      if ( (_blocks[i].block >= 0) && !_blocks[i].done ) 
+        wait( _blocks[i].block );
   }
-  if ( flags() & DescriptorUsed ) {
-    l = snprintf( buff, len, ", +DataDescriptor" );
-    buff += l; len -= l;
+  release();
+}
+
+void UringReadahead::release( void ) {
+  if ( _sqes ) munmap( _sqes, _sqessize );
+  if ( _cq && (_cq != _sq) ) munmap( _cq, _cqsize );
+  if ( _sq ) munmap( _sq, _sqsize );
+  if ( _iov ) free( _iov );
+  if ( _ring >= 0 ) close( _ring );
+  _ring = -1; 
+  _sq = _cq = _sqes = 0; 
+  _iov = 0;
+}
+
+void UringReadahead::submit( Block *b ) {
+  unsigned tail = *_sqtail, i = tail & *_sqmask;
+  struct io_uring_sqe *sqe = _sqes + i;
+  struct iovec *iov = _iov + (b - _blocks);
+  iov->iov_base = b->data + b->len;
+  iov->iov_len = b->want - b->len;
+  memset( sqe, 0, sizeof *sqe );
+  sqe->opcode = IORING_OP_READV;
+  sqe->fd = _fd;
+  sqe->addr = (uint64_t)(uintptr_t) iov;
+  sqe->len = 1;
+  sqe->off = (uint64_t) b->block * _bsize + b->len;
+  sqe->user_data = (uint64_t)( b - _blocks );
+  _sqarray[i] = i;
+  __atomic_store_n( _sqtail, tail + 1, __ATOMIC_RELEASE );
+  while ( syscall( __NR_io_uring_enter, _ring, 1, 0, 0, 0, 0 ) < 0 ) {
+    if ( errno != EINTR ) throw Exception( "io_uring: can't submit read" );
+} }
+
+void UringReadahead::reap( void ) {
+  unsigned head = *_cqhead;
+  while ( head == __atomic_load_n( _cqtail, __ATOMIC_ACQUIRE ) ) {
+    if ( (syscall( __NR_io_uring_enter, _ring, 0, 1, IORING_ENTER_GETEVENTS, 
+                   0, 0 ) < 0) && (errno != EINTR) )
+      throw Exception( "io_uring: can't wait for read" );
   }
-  l = snprintf( buff, len, " (size=%u, %u compressed, crc32=0x%x)",
-    size(), csize(), crc32() );
-  buff += l; len -= l;
-  return olen - len;
+  struct io_uring_cqe *cqe = _cqes + (head & *_cqmask);
+  Block *b = _blocks + cqe->user_data;
+  int res = cqe->res;
+  __atomic_store_n( _cqhead, head + 1, __ATOMIC_RELEASE );
+  if ( res > 0 ) b->len += res;
+  if ( (res == -EINTR) || (res == -EAGAIN) || 
+       ((res > 0) && (b->len < b->want)) ) submit( b );
+  else {
+    if ( res < 0 ) b->error = -res;
+    else if ( b->len < b->want ) b->error = EIO;
+    b->done = 1;
+} }
+
+void UringReadahead::start( long n, long want ) {
+  Block *b = blockOf( n );
+  b->block = n; b->want = want; b->len = 0; b->done = b->error = 0;
+  submit( b );
+}
+
+Readahead::Block *UringReadahead::wait( long n ) {
+  Block *b = blockOf( n );
+  while ( !b->done ) reap();
+  return b;
 }
 
+#endif // ZIP_URING
+
 
 /**
- *  File::inflate decompresses a file stored in a zip archive.
+ *  ReaderState is the state of a Reader.
  */
 
-void File::inflate( void *buffer ) {
-  Buffer *b = (Buffer *) buffer;
-  Header *h = b -> header();
-  int ret;
-  z_stream zs;
-  memset( &zs, 0, sizeof zs );
-  if ( inflateInit2( &zs, -MAX_WBITS ) != Z_OK )
-    throw Exception( "libz: inflateInit2 failed" );
-  zs.next_in = b->contents();
-  zs.next_out = (tByte *) _data;
-  zs.avail_in = h->csize();
-  zs.avail_out = h->size() + 4;
-  switch ( ret = ::inflate( &zs, Z_FINISH ) ) {
-    case Z_OK :
-      throw Exception( "libz: incomplete deflated stream" );
-    case Z_NEED_DICT :
-      throw Exception( "libz: preset dictionary needed for inflate" );
-    case Z_DATA_ERROR :
-      throw Exception( "libz: corrupt inflate input" );
-    case Z_MEM_ERROR :
-      throw Exception( "libz: not enough memory for inflate" );
-    case Z_BUF_ERROR :
-      throw Exception( "libz: not enough space for inflate output" );
-    case Z_STREAM_ERROR :
-      throw Exception( "libz: argument error" );
-    case Z_STREAM_END : {
-      inflateEnd( &zs );
-      // handle CRC32
-      unsigned long crc = crc32( 0L, (tByte *) _data, h->size() );
-      if ( crc != h->crc32() )
-	throw Exception( "zip archive corrupt (CRC32 error)" );
-      break;
+struct ReaderState {
+  int		 fd;		// file to read
+  long		 size;		// file size
+  long		 bsize;		// block size
+  int		 nbuffers;	// #buffers
+  Readahead::Block *blocks;	// buffers
+  Readahead	*readahead;	// reads blocks into buffers
+  const char	*backend;	// name of readahead backend
+
+  ReaderState( void ) { fd = -1; size = bsize = 0; nbuffers = 0; 
+                        blocks = 0; readahead = 0; backend = 0; }
+
+  // waits for the reads in flight, releases the buffers and closes fd
+  ~ReaderState() {
+    if ( readahead ) delete readahead;
+    if ( blocks ) {
+      for ( int i = 0; i < nbuffers; i++ ) free( blocks[i].data );
+      free( blocks );
     }
-    default:
-      debug( "inflate: %d\n", ret );
-      throw Exception( "libz: unknown inflate error" );
-} }
+    if ( fd >= 0 ) close( fd );
+  }
+};
 
 
 /**
- *  File::File takes a Buffer* (opaque) and uses libz-functions to 
- *  decompress the file in the Buffer-object.
+ *  The Reader constructor opens the file at 'path', allocates 'nbuffers' 
+ *  buffers of 'bsize' bytes (rounded to a multiple of 4K) and chooses the
+ *  readahead: io_uring if zip.cpp is compiled with ZIP_URING (on Linux) 
+ *  and the kernel supports it, a reading thread otherwise.
  */
 
-File::File( void *buffer ) {
-  Buffer *b = (Buffer *) buffer;
-  Header *h = b -> header();
-  int datasize = h->hsize() + h->size() + 4;
-  if ( !(_header = malloc( datasize )) ) throw Exception();
-  memcpy( _header, h, h->hsize() );
-  _name = b->heapFilename();
-  if ( h->size() > 0 ) {
-    // decompress file contents
-    _data = ((tByte*) _header) + h->hsize();
-    switch ( h->compression() ) {
-      case Header::Stored : memcpy( _data, b->contents(), h->size() ); break;
-      case Header::Deflated : inflate( buffer ); break;
-      default: throw Exception( "unsupported compression" );
+Reader::Reader( const char *path, int nbuffers, long bsize ) {
+  struct stat st;
+  ReaderState *rs = new ReaderState;
+  _state = rs;
+  rs->nbuffers = (nbuffers > 1)? nbuffers : 2;
+  rs->bsize = (bsize > 4096)? (bsize + 4095) & ~4095L : 4096;
+  try {
+    if ( (rs->fd = open( path, O_RDONLY )) < 0 ) 
+      throw Exception( "zip archive not readable" );
+    if ( fstat( rs->fd, &st ) != 0 ) 
+      throw Exception( "zip archive not readable" );
+    rs->size = (long) st.st_size;
+#if defined(POSIX_FADV_SEQUENTIAL)
+    posix_fadvise( rs->fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+#endif
+    rs->blocks = (Readahead::Block *) 
+      calloc( rs->nbuffers, sizeof(Readahead::Block) );
+    if ( !rs->blocks ) throw Exception();
+    for ( int i = 0; i < rs->nbuffers; i++ ) {
+      void *p;
+      rs->blocks[i].block = -1;
+      if ( posix_memalign( &p, 4096, rs->bsize ) ) throw Exception();
+      rs->blocks[i].data = (tByte *) p;
+    }
+#if defined(ZIP_URING)
+    UringReadahead *u = 
+      new UringReadahead( rs->fd, rs->bsize, rs->nbuffers, rs->blocks );
+    if ( u->isValid() ) { rs->readahead = u; rs->backend = "io_uring"; }
+    else delete u;
+#endif
+    if ( !rs->readahead ) {
+      rs->readahead = 
+        new ThreadReadahead( rs->fd, rs->bsize, rs->nbuffers, rs->blocks );
+      rs->backend = "threads";
+  } }
+  catch ( ... ) { delete rs; _state = 0; throw; }
+}
+
+
+/**
+ *  The Reader destructor waits for the reads in flight and closes the file.
+ */
+
+Reader::~Reader() {
+  delete (ReaderState *) _state;
+  _state = 0;
+}
+
+
+/**
+ *  Reader::backend returns the name of the readahead used ("io_uring" or
+ *  "threads").
+ */
+
+const char *Reader::backend( void ) const {
+  return ((ReaderState *) _state) -> backend;
+}
+
+
+/**
+ *  Reader::scan reads the file and passes it to Stream::scan block by
+ *  block. While a block is scanned the following blocks are read, so the
+ *  file is read and decompressed at the same time. When the file has 
+ *  been read Stream::finish is called.
+ */
+
+void Reader::scan( Stream &stream ) {
+  ReaderState *rs = (ReaderState *) _state;
+  long nblocks = (rs->size + rs->bsize - 1) / rs->bsize;
+  Readahead *ra = rs->readahead;
+  // the last block may be short
+  auto want = [rs]( long n ) { 
+    return std::min( rs->bsize, rs->size - n * rs->bsize ); };
+  for ( long n = 0; (n < rs->nbuffers) && (n < nblocks); n++ ) 
+    ra -> start( n, want( n ) );
+  for ( long n = 0; n < nblocks; n++ ) {
+    Readahead::Block *b = ra -> wait( n );
+    if ( b->error ) {
+      errno = b->error;
+      throw Exception( "zip archive not readable" );
     }
+    stream.scan( (const char *) b->data, b->len );
+    if ( n + rs->nbuffers < nblocks ) 
+      ra -> start( n + rs->nbuffers, want( n + rs->nbuffers ) );
   }
-  else _data = 0;
+  stream.finish();
 }
 
 
 /**
- *  The File::~File destructor releases all allocated data.
+ *  The Extractor constructor defines the directory to write files to.
  */
 
-File::~File() {
-  if ( _header ) free( _header );
-  if ( _name ) free( _name );
-  _header = _data = 0;
-  _name = 0;
+Extractor::Extractor( const char *dir ) {
+  if ( !(_dir = strdup( dir )) ) throw Exception();
+  _fd = -1;
+  _path[0] = '\0';
 }
 
 
 /**
- *  File::size returns the file's size (uncompressed).
+ *  The Extractor destructor closes and removes an incompletely written file.
  */
 
-int File::size( void ) const {
-  return ((Header *)_header) -> size();
+Extractor::~Extractor() {
+  if ( _fd >= 0 ) { close( _fd ); unlink( _path ); }
+  free( _dir );
+  _dir = 0;
 }
 
 
 /**
- *  The default implementation of StreamDelegate::handleFile prints the file 
- *  name and some header data to stdout.
+ *  Extractor::beginFile creates the file (or directory) and preallocates
+ *  its size, the file contents are then written chunk by chunk.
  */
 
-void StreamDelegate::handleFile( File *file ) {
-  char buff[1024];
-  Header *h = (Header*)(file->header());
-  h -> toAscii( buff, 1024 );
-  printf( "%s: %s\n", file->name(), buff );
-  fflush( stdout );
+bool Extractor::beginFile( File *file ) {
+  if ( _fd >= 0 ) { close( _fd ); unlink( _path ); _fd = -1; }
+  _fd = createFile( _dir, file, _path, sizeof _path );
+  if ( _fd >= 0 ) preallocate( _fd, file );
+  return true;
 }
 
 
 /**
- *  The Stream constructor allocates a Buffer object to store the read data 
+ *  Extractor::handleChunk writes a chunk of file contents.
  */
 
-Stream::Stream( StreamDelegate &delegate ) {
-  _delegate = &delegate;
-  _buffer = new Buffer;
-  _bytes_read = 0;
+void Extractor::handleChunk( File *file, const void *data, size_t len ) {
+  if ( _fd >= 0 ) writeBytes( _fd, data, len );
 }
 
 
 /**
- *  The Stream destructor releases all allocated structures.
+ *  Extractor::endFile sets the file's modification time and closes it.
+ *  If the file is corrupt it is removed and an Exception is thrown.
  */
 
-Stream::~Stream() {
-  Buffer *b = (Buffer *) _buffer;
-  _delegate = 0;
-  if ( b ) delete b;
-  _buffer = 0;
+void Extractor::endFile( File *file, bool crcOk ) {
+  int fd = _fd;
+  if ( fd < 0 ) return;
+  _fd = -1;
+  if ( !crcOk ) {
+    close( fd );
+    unlink( _path );
+    throw Exception( "zip archive corrupt (CRC32 error)" );
+  }
+  try { closeFile( fd, file ); }
+  catch ( ... ) { unlink( _path ); throw; }
 }
 
 
 /**
- *  Stream::scan scans the given data for a zip file in a zip archive. If
- *  a complete file could be found, the File is passed to the StreamDelegate.
+ *  QueueState is the list of files kept by a Queue.
  */
 
-void Stream::scan( const char *buff, int blen ) {
-  Buffer *b = (Buffer *) _buffer;
-  int bufflen = blen;
-  while ( bufflen > 0 ) {
-    b->addData( &buff, &bufflen );
-    _bytes_read += (blen - bufflen);
-    blen = bufflen;
-    if ( b->fileFound() ) {
-      File *f = new File( b );
-      _delegate -> handleFile( f );
-      b->reset();
-} } }
+struct QueueState {
+  std::mutex		 mutex;		// protects files
+  std::deque<File *>	 files;		// files not yet taken
+};
+
+
+/**
+ *  The Queue destructor deletes the files not taken.
+ */
+
+Queue::Queue( void ) {
+  _state = new QueueState;
+}
+
+Queue::~Queue() {
+  QueueState *qs = (QueueState *) _state;
+  for ( File *f: qs->files ) delete f;
+  delete qs;
+  _state = 0;
+}
+
+
+/**
+ *  Queue::handleFile keeps the file, a file referencing the data passed 
+ *  to Stream::scan (File::isView) is copied.
+ */
+
+void Queue::handleFile( File *file ) {
+  QueueState *qs = (QueueState *) _state;
+  if ( file->isView() ) file -> keep();
+  std::lock_guard<std::mutex> lock( qs->mutex );
+  qs->files.push_back( file );
+}
+
+
+/**
+ *  Queue::next returns the file queued first (which must be deleted after
+ *  use) or 0 if no file is queued.
+ */
+
+File *Queue::next( void ) {
+  QueueState *qs = (QueueState *) _state;
+  std::lock_guard<std::mutex> lock( qs->mutex );
+  if ( qs->files.empty() ) return 0;
+  File *ret = qs->files.front();
+  qs->files.pop_front();
+  return ret;
+}
+
+
+/**
+ *  Queue::count returns the number of files queued.
+ */
+
+long Queue::count( void ) const {
+  QueueState *qs = (QueueState *) _state;
+  std::lock_guard<std::mutex> lock( qs->mutex );
+  return (long) qs->files.size();
+}
+
+
+/**
+ *  A WriterEntry describes a file written by a Writer (for the central
+ *  directory).
+ */
+
+struct WriterEntry {
+  char		*name;		// file name
+  unsigned	 method;	// compression method
+  unsigned	 flags;		// Header flags
+  unsigned	 mtime, mdate;	// DOS modification time and date
+  unsigned	 crc;		// CRC32 of file contents
+  unsigned	 wcrc;		// CRC32 of the data written so far
+  uint64_t	 size;		// uncompressed size
+  uint64_t	 csize;		// compressed size
+  uint64_t	 offset;	// offset of local header
+  int		 zip64;		// local header has a Zip64 extra field
+};
+
+/**
+ *  A WriterBlock is a piece of a file compressed independently. Its input
+ *  is preceded by up to 32K of the preceding input used as dictionary.
+ */
+
+struct WriterBlock {
+  WriterEntry	*entry;		// file the block belongs to
+  long		 seq;		// position in output
+  tByte		*in;		// dictionary + input
+  long		 dlen;		// #bytes of dictionary
+  long		 ilen;		// #bytes of input
+  int		 first, last;	// first/last block of file
+  tByte		*out;		// compressed data
+  long		 olen;		// #bytes of compressed data
+  unsigned	 crc;		// CRC32 of input
+  WriterBlock( void ) { in = out = 0; }
+  ~WriterBlock() { if ( out && (out != in + dlen) ) free( out ); free( in ); }
+};
+
+/**
+ *  WriterState is the opaque state of a zip::Writer. Blocks are compressed
+ *  by a pool of threads and written in order by the thread having 
+ *  compressed the next block to write (like Pipeline).
+ */
+
+class WriterState {
+
+  public:
+  int		 _fd;		// file to write to
+  int		 _level;	// deflate level
+  int		 _maxPending;	// max #blocks in pipeline
+  std::vector<std::thread> _workers; // worker threads
+  std::vector<WriterEntry *> _entries; // files written
+  std::mutex	 _mutex;	// protects the following data
+  std::condition_variable _work;  // signalled when a block has been queued
+  std::condition_variable _done;  // signalled when a block has been written
+  std::deque<WriterBlock *> _queue; // blocks to compress
+  std::map<long, WriterBlock *> _finished; // compressed blocks out of order
+  long		 _seq;		// sequence number of next block queued
+  long		 _next;		// sequence number of next block to write
+  long		 _pending;	// #blocks queued and not yet written
+  int		 _stop;		// terminate worker threads
+  int		 _failed;	// an error has occurred
+  int		 _closed;	// central directory has been written
+  Exception	 _error;	// first error
+  std::mutex	 _deliver;	// serializes writing
+  uint64_t	 _offset;	// #bytes written
+
+  // size of blocks and of dictionaries
+  static const long BlockSize = 128*1024, DictSize = 32*1024;
+
+  WriterState( int fd, int nthreads, int level );
+  ~WriterState();
+
+  // records an error (_mutex must be locked)
+  void fail( const Exception &e ) { if ( !_failed ) { _error = e; _failed = 1; } }
+
+  // throws the first error
+  void check( void ) { if ( _failed ) throw _error; }
+
+  // compresses queued blocks until _stop is set
+  void work( void );
+
+  // compresses a block
+  void compress( WriterBlock *b );
+
+  // passes a compressed block (in any order) to be written
+  void pass( WriterBlock *b );
+
+  // writes a block (in order)
+  void write( WriterBlock *b );
+
+  // queues a block for compression
+  void queue( WriterBlock *b );
+
+  // adds a file of 'size' bytes read by 'read', 'crc' returns the CRC32
+  // of the file contents (called before reading if the file is stored)
+  void add( const char *name, uint64_t size, time_t mtime, bool compress,
+            const std::function<void (tByte *, long)> &read,
+            const std::function<unsigned (void)> &crc );
+
+  // writes the central directory
+  void finish( void );
+
+  // writes local header, data descriptor or central header of 'e'
+  void writeHeader( WriterEntry *e );
+  void writeDescriptor( WriterEntry *e );
+  void writeCentral( std::string &out, WriterEntry *e );
+
+  // appends a record to 'out'
+  static void append( std::string &out, const void *rec, size_t len )
+    { out.append( (const char *) rec, len ); }
+
+  // writes 'out' to the file
+  void output( const std::string &out ) 
+    { writeBytes( _fd, out.data(), out.size() ); _offset += out.size(); }
+
+}; // class WriterState
+
+WriterState::WriterState( int fd, int nthreads, int level ) {
+  _fd = fd;
+  _level = level;
+  _maxPending = 4 * ((nthreads > 1)? nthreads : 1);
+  _seq = _next = _pending = 0;
+  _stop = _failed = _closed = 0;
+  _offset = 0;
+  if ( nthreads > 1 )
+    for ( int i = 0; i < nthreads; i++ )
+      _workers.push_back( std::thread( &WriterState::work, this ) );
+}
+
+WriterState::~WriterState() {
+  { std::unique_lock<std::mutex> lock( _mutex );
+    while ( _pending > (long) _finished.size() ) _done.wait( lock );
+    _stop = 1; }
+  _work.notify_all();
+  for ( auto &t: _workers ) t.join();
+  for ( auto &b: _finished ) delete b.second;
+  for ( WriterEntry *e: _entries ) { free( e->name ); delete e; }
+}
+
+void WriterState::work( void ) {
+  std::unique_lock<std::mutex> lock( _mutex );
+  while ( true ) {
+    while ( _queue.empty() && !_stop ) _work.wait( lock );
+    if ( _queue.empty() ) return;
+    WriterBlock *b = _queue.front();
+    _queue.pop_front();
+    lock.unlock();
+    pass( b );
+    lock.lock();
+} }
+
+void WriterState::compress( WriterBlock *b ) {
+  struct Deflater {
+    ZStream zs;
+    int level;
+    Deflater( void ) { memset( &zs, 0, sizeof zs ); level = -2; }
+    ~Deflater() { if ( level != -2 ) ZLIB(deflateEnd)( &zs ); }
+  };
+  static thread_local Deflater d;	// reused by this thread
+  b->crc = (unsigned) updateCrc( 0, b->in + b->dlen, b->ilen );
+  if ( b->entry->method == Header::Stored ) 
+    { b->out = b->in + b->dlen; b->olen = b->ilen; return; }
+  if ( d.level != _level ) {
+    if ( d.level != -2 ) ZLIB(deflateEnd)( &d.zs );
+    d.level = -2;
+    if ( ZLIB(deflateInit2)( &d.zs, _level, Z_DEFLATED, -MAX_WBITS, 8, 
+                             Z_DEFAULT_STRATEGY ) != Z_OK )
+      throw Exception( "libz: deflateInit2 failed" );
+    d.level = _level;
+  }
+  else if ( ZLIB(deflateReset)( &d.zs ) != Z_OK )
+    throw Exception( "libz: deflateReset failed" );
+  if ( b->dlen && (ZLIB(deflateSetDictionary)( &d.zs, b->in, 
+                     (unsigned) b->dlen ) != Z_OK) )
+    throw Exception( "libz: deflateSetDictionary failed" );
+  // a block not being the last ends byte aligned (Z_SYNC_FLUSH)
+  long osize = (long) ZLIB(deflateBound)( &d.zs, b->ilen ) + 16;
+  if ( !(b->out = (tByte *) malloc( osize )) ) throw Exception();
+  d.zs.next_in = b->in + b->dlen;
+  d.zs.avail_in = (unsigned) b->ilen;
+  d.zs.next_out = b->out;
+  d.zs.avail_out = (unsigned) osize;
+  int ret = ZLIB(deflate)( &d.zs, b->last? Z_FINISH : Z_SYNC_FLUSH );
+  if ( (ret != (b->last? Z_STREAM_END : Z_OK)) || d.zs.avail_in )
+    throw Exception( "libz: deflate failed" );
+  b->olen = osize - d.zs.avail_out;
+}
+
+void WriterState::pass( WriterBlock *b ) {
+  try { compress( b ); }
+  catch ( const Exception &e ) 
+    { std::lock_guard<std::mutex> lock( _mutex ); fail( e ); }
+  std::lock_guard<std::mutex> dlock( _deliver );
+  std::unique_lock<std::mutex> lock( _mutex );
+  _finished[b->seq] = b;
+  while ( !_finished.empty() && (_finished.begin()->first == _next) ) {
+    b = _finished.begin()->second;
+    _finished.erase( _finished.begin() );
+    _next++;
+    int failed = _failed;
+    lock.unlock();
+    if ( !failed ) {
+      try { write( b ); }
+      catch ( const Exception &e ) 
+        { std::lock_guard<std::mutex> elock( _mutex ); fail( e ); }
+    }
+    delete b;
+    lock.lock();
+    _pending--;
+    _done.notify_all();
+} }
+
+void WriterState::write( WriterBlock *b ) {
+  WriterEntry *e = b->entry;
+  if ( b->first ) {
+    e->offset = _offset;
+    e->wcrc = b->crc;
+    e->csize = b->olen;
+    // the CRC of stored files is known in advance, a deflated file of
+    // multiple blocks needs a data descriptor
+    if ( e->method != Header::Stored ) {
+      e->crc = b->crc;
+      if ( !b->last ) e->flags |= Header::DescriptorUsed;
+    }
+    writeHeader( e );
+  }
+  else {
+    e->wcrc = (unsigned) ZLIB(crc32_combine)( e->wcrc, b->crc, b->ilen );
+    e->csize += b->olen;
+  }
+  if ( b->olen > 0 ) writeBytes( _fd, b->out, b->olen );
+  _offset += b->olen;
+  if ( b->last ) {
+    if ( e->method == Header::Stored ) {
+      if ( e->wcrc != e->crc ) 
+        throw Exception( "file changed while being added" );
+    }
+    else if ( !b->first ) { e->crc = e->wcrc; writeDescriptor( e ); }
+  }
+}
+
+void WriterState::queue( WriterBlock *b ) {
+  std::unique_lock<std::mutex> lock( _mutex );
+  while ( !_failed && (_pending >= _maxPending) ) _done.wait( lock );
+  if ( _failed ) { delete b; check(); }
+  b->seq = _seq++;
+  _pending++;
+  if ( _workers.empty() ) { lock.unlock(); pass( b ); }
+  else { _queue.push_back( b ); _work.notify_one(); }
+}
+
+void WriterState::add( const char *name, uint64_t size, time_t mtime, 
+                       bool compress, 
+                       const std::function<void (tByte *, long)> &read,
+                       const std::function<unsigned (void)> &crc ) {
+  WriterEntry *e;
+  { std::lock_guard<std::mutex> lock( _mutex );
+    check();
+    if ( _closed ) throw Exception( "zip archive closed" );
+    e = new WriterEntry;
+    memset( e, 0, sizeof *e );
+    if ( !(e->name = strdup( name )) ) { delete e; throw Exception(); }
+    _entries.push_back( e ); }
+  e->method = (compress && (size > 0))? Header::Deflated : Header::Stored;
+  if ( e->method == Header::Stored ) e->crc = crc();
+  for ( const char *p = name; *p; p++ ) 
+    if ( *p & 0x80 ) { e->flags |= Header::Utf8Encoded; break; }
+  // a large file needs 64 bit sizes in its local header resp. descriptor
+  e->zip64 = (size >= 0xff000000);
+  struct tm tm;
+  if ( mtime == 0 ) mtime = time( 0 );
+  localtime_r( &mtime, &tm );
+  if ( tm.tm_year < 80 ) { tm.tm_year = 80; tm.tm_mon = 0; tm.tm_mday = 1; }
+  e->mdate = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+  e->mtime = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+  e->size = size;
+  // the dictionary of a block is copied from the preceding block before
+  // that is queued
+  WriterBlock *prev = 0, *b = 0;
+  uint64_t pos = 0;
+  try {
+    do {
+      b = new WriterBlock;
+      b->entry = e;
+      b->ilen = (size - pos > (uint64_t) BlockSize)? BlockSize : (long)(size - pos);
+      b->dlen = (e->method == Header::Deflated)? 
+                ((pos > (uint64_t) DictSize)? DictSize : (long) pos) : 0;
+      b->first = (pos == 0);
+      b->last = (pos + b->ilen == size);
+      if ( !(b->in = (tByte *) malloc( b->dlen + b->ilen + 1 )) ) 
+        throw Exception();
+      if ( b->dlen ) 
+        memcpy( b->in, prev->in + prev->dlen + prev->ilen - b->dlen, b->dlen );
+      if ( prev ) { WriterBlock *p = prev; prev = 0; queue( p ); }
+      read( b->in + b->dlen, b->ilen );
+      pos += b->ilen;
+      prev = b; b = 0;
+    } while ( pos < size );
+    WriterBlock *last = prev; 
+    prev = 0;
+    queue( last );
+  }
+  catch ( ... ) { 
+    if ( prev ) delete prev; 
+    if ( b ) delete b; 
+    std::lock_guard<std::mutex> lock( _mutex );
+    if ( !_failed ) fail( Exception( "zip archive incomplete" ) );
+    throw; 
+  }
+}
+
+void WriterState::writeHeader( WriterEntry *e ) {
+  Header h;
+  memset( &h, 0, sizeof h );
+  memcpy( &h._signature, Header::signature, 4 );
+  number2bytes( h._version, e->zip64? 45 : 20 );
+  number2bytes( h._flags, e->flags );
+  number2bytes( h._compression, e->method );
+  number2bytes( h._mtime, e->mtime );
+  number2bytes( h._mdate, e->mdate );
+  size_t nlen = strlen( e->name );
+  number2bytes( h._fnlength, (unsigned) nlen );
+  // stored files are written as they are read, so their sizes are known
+  uint64_t csize = (e->method == Header::Stored)? e->size : e->csize;
+  if ( !(e->flags & Header::DescriptorUsed) ) {
+    number2bytes( h._crc32, e->crc );
+    number2bytes( h._csize, (unsigned) csize );
+    number2bytes( h._size, (unsigned) e->size );
+  }
+  std::string out;
+  if ( e->zip64 ) {
+    // sizes are 0 if they are in the data descriptor
+    tByte8 sizes[2];
+    memset( sizes, 0, sizeof sizes );
+    if ( !(e->flags & Header::DescriptorUsed) ) {
+      number2bytes( sizes[0], e->size );
+      number2bytes( sizes[1], csize );
+    }
+    number2bytes( h._extralength, 4 + sizeof sizes );
+    number2bytes( h._csize, Zip64Mark );
+    number2bytes( h._size, Zip64Mark );
+    append( out, &h, sizeof h );
+    out.append( e->name, nlen );
+    tByte2 id[2];
+    number2bytes( id[0], Zip64Extra ); number2bytes( id[1], sizeof sizes );
+    append( out, id, sizeof id );
+    append( out, sizes, sizeof sizes );
+  }
+  else { append( out, &h, sizeof h ); out.append( e->name, nlen ); }
+  output( out );
+}
+
+void WriterState::writeDescriptor( WriterEntry *e ) {
+  std::string out;
+  if ( e->zip64 ) {
+    Zip64DataDescriptor dd;
+    memcpy( &dd._signature, DataDescriptor::signature, 4 );
+    number2bytes( dd._crc32, e->crc );
+    number2bytes( dd._csize, e->csize );
+    number2bytes( dd._size, e->size );
+    append( out, &dd, sizeof dd );
+  }
+  else if ( e->csize >= Zip64Mark ) 
+    throw Exception( "zip archive too large (file not compressible)" );
+  else {
+    DataDescriptor dd;
+    memcpy( &dd._signature, DataDescriptor::signature, 4 );
+    number2bytes( dd._crc32, e->crc );
+    number2bytes( dd._csize, (unsigned) e->csize );
+    number2bytes( dd._size, (unsigned) e->size );
+    append( out, &dd, sizeof dd );
+  }
+  output( out );
+}
+
+void WriterState::writeCentral( std::string &out, WriterEntry *e ) {
+  CentralHeader ch;
+  tByte8 ext[3];
+  int next = 0;
+  memset( &ch, 0, sizeof ch );
+  memcpy( &ch._signature, CentralHeader::signature, 4 );
+  number2bytes( ch._madeby, (3 << 8) | 45 );	// Unix
+  number2bytes( ch._flags, e->flags );
+  number2bytes( ch._compression, e->method );
+  number2bytes( ch._mtime, e->mtime );
+  number2bytes( ch._mdate, e->mdate );
+  number2bytes( ch._crc32, e->crc );
+  // values not fitting into 32 bits are in the Zip64 extra field
+  const uint64_t vals[3] = { e->size, e->csize, e->offset };
+  tByte4 *fields[3] = { &ch._size, &ch._csize, &ch._offset };
+  for ( int i = 0; i < 3; i++ ) {
+    if ( vals[i] >= Zip64Mark ) {
+      number2bytes( *fields[i], Zip64Mark );
+      number2bytes( ext[next++], vals[i] );
+    }
+    else number2bytes( *fields[i], (unsigned) vals[i] );
+  }
+  number2bytes( ch._version, (next || e->zip64)? 45 : 20 );
+  size_t nlen = strlen( e->name );
+  number2bytes( ch._fnlength, (unsigned) nlen );
+  if ( next ) number2bytes( ch._extralength, 4 + 8*next );
+  int dir = nlen && (e->name[nlen-1] == '/');
+  number2bytes( ch._eattr, (dir? 040755u : 0100644u) << 16 );
+  append( out, &ch, sizeof ch );
+  out.append( e->name, nlen );
+  if ( next ) {
+    tByte2 id[2];
+    number2bytes( id[0], Zip64Extra ); number2bytes( id[1], 8*next );
+    append( out, id, sizeof id );
+    append( out, ext, 8*next );
+} }
+
+void WriterState::finish( void ) {
+  { std::unique_lock<std::mutex> lock( _mutex );
+    while ( _pending > 0 ) _done.wait( lock );
+    check();
+    if ( _closed ) return;
+    _closed = 1; }
+  std::string out;
+  uint64_t cdoffset = _offset, n = _entries.size();
+  for ( WriterEntry *e: _entries ) writeCentral( out, e );
+  uint64_t cdsize = out.size();
+  if ( (n >= 0xffff) || (cdoffset >= Zip64Mark) || (cdsize >= Zip64Mark) ) {
+    Zip64EndOfCentralDirectory eocd64;
+    memset( &eocd64, 0, sizeof eocd64 );
+    memcpy( &eocd64._signature, Zip64EndOfCentralDirectory::signature, 4 );
+    number2bytes( eocd64._rsize, sizeof eocd64 - 12 );
+    number2bytes( eocd64._madeby, (3 << 8) | 45 );
+    number2bytes( eocd64._version, 45 );
+    number2bytes( eocd64._ndisk, n );
+    number2bytes( eocd64._nentries, n );
+    number2bytes( eocd64._cdsize, cdsize );
+    number2bytes( eocd64._cdoffset, cdoffset );
+    Zip64Locator loc;
+    memset( &loc, 0, sizeof loc );
+    memcpy( &loc._signature, Zip64Locator::signature, 4 );
+    number2bytes( loc._offset, cdoffset + cdsize );
+    number2bytes( loc._ndisks, 1 );
+    append( out, &eocd64, sizeof eocd64 );
+    append( out, &loc, sizeof loc );
+  }
+  EndOfCentralDirectory eocd;
+  memset( &eocd, 0, sizeof eocd );
+  memcpy( &eocd._signature, EndOfCentralDirectory::signature, 4 );
+  number2bytes( eocd._ndisk, (n >= 0xffff)? 0xffff : (unsigned) n );
+  number2bytes( eocd._nentries, (n >= 0xffff)? 0xffff : (unsigned) n );
+  number2bytes( eocd._cdsize, (cdsize >= Zip64Mark)? 
+                Zip64Mark : (unsigned) cdsize );
+  number2bytes( eocd._cdoffset, (cdoffset >= Zip64Mark)? 
+                Zip64Mark : (unsigned) cdoffset );
+  append( out, &eocd, sizeof eocd );
+  output( out );
+}
+
+
+/**
+ *  The Writer constructor prepares writing a zip archive to file 'fd' 
+ *  using 'nthreads' threads (#cores if nthreads <= 0) to deflate files 
+ *  with compression 'level' (0-9).
+ */
+
+Writer::Writer( int fd, int nthreads, int level ) {
+  if ( nthreads <= 0 ) nthreads = (int) std::thread::hardware_concurrency();
+  _state = new WriterState( fd, nthreads, level );
+}
+
+
+/**
+ *  The Writer destructor waits for the worker threads, it doesn't write
+ *  the central directory (see finish) and doesn't close the file.
+ */
+
+Writer::~Writer() {
+  delete (WriterState *) _state;
+  _state = 0;
+}
+
+
+/**
+ *  Writer::add adds the file 'name' with contents 'data' ('size' bytes)
+ *  and modification time 'mtime' (0: now). The data is copied, it is 
+ *  deflated if 'compress' is true. Names ending with '/' denote 
+ *  directories.
+ */
+
+void Writer::add( const char *name, const void *data, long size, 
+                  time_t mtime, bool compress ) {
+  const tByte *ptr = (const tByte *) data;
+  ((WriterState *) _state) -> add( name, size, mtime, compress, 
+    [&ptr]( tByte *buff, long len ) { memcpy( buff, ptr, len ); ptr += len; },
+    [data, size]() 
+      { return (unsigned) updateCrc( 0, (const tByte *) data, size ); } );
+}
+
+
+/**
+ *  Writer::addFile adds the file at 'path' as 'name' (with the file's
+ *  modification time).
+ */
+
+void Writer::addFile( const char *name, const char *path, bool compress ) {
+  struct stat st;
+  int fd = open( path, O_RDONLY );
+  if ( fd < 0 ) throw Exception( "can't open file" );
+  if ( fstat( fd, &st ) ) { close( fd ); throw Exception( "can't read file" ); }
+  try {
+    ((WriterState *) _state) -> add( name, st.st_size, st.st_mtime, compress,
+      [fd]( tByte *buff, long len ) {
+        while ( len > 0 ) {
+          ssize_t n = read( fd, buff, len );
+          if ( n <= 0 ) throw Exception( "can't read file" );
+          buff += n;
+          len -= n;
+      } },
+      [fd, &st]() {
+        tByte buff[64*1024];
+        unsigned long crc = 0;
+        for ( off_t pos = 0; pos < st.st_size; ) {
+          size_t len = (st.st_size - pos > (off_t) sizeof buff)? 
+                       sizeof buff : (size_t)(st.st_size - pos);
+          ssize_t n = pread( fd, buff, len, pos );
+          if ( n <= 0 ) throw Exception( "can't read file" );
+          crc = updateCrc( crc, buff, n );
+          pos += n;
+        }
+        return (unsigned) crc;
+      } );
+  }
+  catch ( ... ) { close( fd ); throw; }
+  close( fd );
+}
+
+
+/**
+ *  Writer::finish waits until all files have been written and writes the
+ *  central directory. The first error encountered is thrown.
+ */
+
+void Writer::finish( void ) {
+  ((WriterState *) _state) -> finish();
+}
+
 
 
 } // namespace zip
@@ -1,6 +1,7 @@
 /** zip.hh
  *
- *  Defines some classes to scan and extract files from zip archives.
+ *  Defines some classes to scan and extract files from zip archives and
+ *  to write zip archives (zip::Writer).
  *  Zip archives are defined in:
  *    http://www.pkware.com/documents/casestudies/APPNOTE.TXT
  *
@@ -8,12 +9,18 @@
  *  is optionally succeeded by a data descriptor.
  *  A data descriptor has to be used if the file size and/or CRC hash sum are
  *  not defined in the header.
+ *  The end of compressed files without sizes is found by decompressing 
+ *  them, stored files are copied until the signature of their data 
+ *  descriptor is found.
  *
  *  The main class defined here is a zip::Stream. A Stream object is given data
  *  from some byte stream representing a zip archive. When zip:Stream reads a 
  *  complete file from the data given to it, a method 'handleFile' of a class
  *  derived from the pure virtual class zip::StreamDelegate is called.
  *  This method is used to consume the file (e.g. in a different thread).
+ *  The compressed file data is not buffered by zip::Stream, it is 
+ *  decompressed while it is received. Only the header and the uncompressed
+ *  contents of the current file are kept in memory.
  *
  *  Typically zip::Stream is used as follows:
  *
@@ -33,6 +40,25 @@
  *
  *  The zip::File *file parameter passed to MyDelegate::handleFile is allocated
  *  and must be deleted after use.
+ *
+ *  Large files may be consumed with bounded memory by overriding beginFile
+ *  to return true. The file contents are then passed in chunks to 
+ *  handleChunk and endFile is called when the file is complete. In this
+ *  case the zip::File passed (without data) is owned by zip::Stream:
+ *
+ *    bool MyDelegate::beginFile( zip::File *file )
+ *      { return file->size() > 1024*1024; }
+ *    void MyDelegate::handleChunk( zip::File *file, const void *data,
+ *                                  size_t len ) 
+ *      { write( fd, data, len ); }
+ *    void MyDelegate::endFile( zip::File *file, bool crcOk ) 
+ *      { close( fd ); }
+ *
+ *  Unwanted files may be skipped cheaply by overriding shouldAccept:
+ *
+ *    bool MyDelegate::shouldAccept( zip::File *file )
+ *      { return str_gmatch( file->name(), "*.xml" ); }
+ *
  *  Typically a 3-thread model may be used to receive, decompress and handle
  *  zipped files:
  *   
@@ -41,6 +67,55 @@
  *      is passed to zip::StreamDelegate::handleFile also in thread 2
  *    - handleFile passes the file for further processing to thread 3.
  *
+ *  zip::Stream provides thread 2 itself:
+ *
+ *    zipstream.setReceiving( 16 );	// queue up to 16 pieces of data
+ *    // called by thread 1 (e.g. a download callback):
+ *    zipstream.receive( buff, bufflen );
+ *    ...
+ *    zipstream.finish();		// all data received has been scanned
+ *
+ *  receive copies the data to a lock-free queue and returns at once 
+ *  unless the queue is full. While the scanning thread runs only receive,
+ *  finish and resumeOffset may be called by thread 1.
+ *
+ *  Alternatively zip::Stream may decompress files in parallel:
+ *
+ *    zipstream.setThreads( 4 );
+ *    while ( !eof ) zipstream.scan( buff, bufflen );
+ *    zipstream.finish();
+ *
+ *  Then zip::Stream::scan only separates the compressed files and a pool of 
+ *  worker threads decompresses them and calls handleFile.
+ *
+ *  With zipstream.setLazy( true ) compressed files are passed to handleFile 
+ *  still compressed. They are decompressed when File::data is called first, 
+ *  so files only looked at by name or size are never inflated. Files without
+ *  sizes in their header are decompressed by scan in either case, that's 
+ *  how their end is found.
+ *
+ *  An interrupted download may be resumed after the last file passed to
+ *  the delegate. Files already passed are not downloaded again:
+ *
+ *    long offset = zipstream.resumeOffset();
+ *    ...
+ *    zip::Stream resumed( delegate );
+ *    resumed.setOffset( offset );
+ *    // request the archive from 'offset' on (HTTP Range: bytes=offset-)
+ *    while ( !eof ) resumed.scan( buff, bufflen );
+ *
+ *  A zip archive stored in a file may be scanned by
+ *
+ *    zipstream.scanFile( "issue.zip" );
+ *
+ *  The file is mapped into memory, stored files and compressed files
+ *  passed undecompressed (see setThreads and setLazy) then refer to their
+ *  data in the mapping instead of being copied.
+ *
+ *  zipstream.stats() returns counters (zip::StreamStats) showing e.g. 
+ *  which archives need files without sizes to be copied until their data
+ *  descriptor or cause many reallocations of the stream buffer.
+ *
  *  A zip file is structured as follows:
  *
  *    file header 1
@@ -66,7 +141,11 @@
  *    zip64 end of central directory locator
  *    end of central directory record
  *
- *  Encrypted zip files are currently not supported.
+ *  Zip64 archives (with files or archives larger than 4 GB) are supported
+ *  on 64 bit platforms. Encrypted zip files are currently not supported.
+ *  Files may be stored or deflated, Zstandard (method 93) and LZMA 
+ *  (method 14) compressed files are supported if zip.cpp is compiled with 
+ *  ZIP_ZSTD resp. ZIP_LZMA defined (and linked with libzstd resp. liblzma).
  */
 
 #ifndef __zipfile_h
@@ -75,8 +154,10 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
 #include <iostream>
 #include <exception>
+#include <atomic>
 
 namespace zip {
 
@@ -91,23 +172,88 @@ class Exception : public std::exception {
 };
 
 
+/**
+ *  An Allocator provides the storage of zip::File's and of the buffers 
+ *  used by zip::Stream. The standard Allocator uses malloc and free.
+ */
+
+class Allocator {
+  public:
+  virtual ~Allocator() {}
+  // returns 'size' bytes of storage or 0 if no memory is available
+  virtual void *alloc( size_t size ) = 0;
+  // releases storage of 'size' bytes returned by alloc
+  virtual void release( void *ptr, size_t size ) = 0;
+  // changes the size of storage returned by alloc (copies the contents)
+  virtual void *resize( void *ptr, size_t size, size_t nsize );
+  // the Allocator using malloc/free
+  static Allocator &standard( void );
+};
+
+
+/**
+ *  A Pool is an Allocator recycling the storage of released Files in
+ *  size classes carved from large slabs. Hence Streams don't compete for 
+ *  the process' heap. The storage of all Files allocated from a Pool may 
+ *  be released at once by Pool::clear (or the Pool's destructor) instead
+ *  of deleting each File. A Pool may be used by several Streams and 
+ *  threads concurrently, but Pool::clear must not be called before all 
+ *  Streams using the Pool have been destroyed.
+ *
+ *    zip::Pool pool;
+ *    {
+ *      zip::Stream zipstream( delegate, pool );
+ *      ...
+ *    }
+ *    pool.clear();  // all zip::File's are gone
+ */
+
+class Pool : public Allocator {
+  private:
+  void			*_state;	// opaque pool state
+  public:
+  Pool( size_t slabsize = 1024*1024 );
+  ~Pool();
+  void *alloc( size_t size );
+  void release( void *ptr, size_t size );
+  void *resize( void *ptr, size_t size, size_t nsize );
+  void clear( void );
+};
+
+
 /**
  *  A file stored in a zip archive
  */
 
 class File {
   friend class Stream;
+  friend class Buffer;
+  friend class Archive;
   private:
   void		*_header;	// complete Header
   void		*_data;		// uncompressed data
   char		*_name;		// file name
+  int		 _flags;	// state of file contents
+  enum { 
+    Compressed = 1,		// data not yet decompressed
+    View = 2			// data refers to data passed to Stream::scan
+  };
+  void setContents( void *buffer );
+  File( void ) { _header = _data = 0; _name = 0; _flags = 0; }
   public:
   File( void *buffer );
   ~File();
-  void inflate( void *buffer );
-  void *data( void ) const { return _data; }
+  static void *operator new( size_t size, Allocator &allocator );
+  static void *operator new( size_t size );
+  static void operator delete( void *ptr, Allocator &allocator );
+  static void operator delete( void *ptr );
+  void inflate( void );
+  void keep( void );
+  bool isView( void ) const { return _flags & View; }
+  bool isCompressed( void ) const { return _flags & Compressed; }
+  void *data( void ) { if ( _flags & Compressed ) inflate(); return _data; }
   void *header( void ) const { return _header; }
-  int size( void ) const;
+  long size( void ) const;
   const char *name( void ) const { return _name; }
 }; // class File
 
@@ -118,8 +264,46 @@ class File {
 
 class StreamDelegate {
   public:
+  virtual ~StreamDelegate() {}
   // handleFile is called by zip::Stream when a file has been found
   virtual void handleFile( File *file );
+  // shouldAccept is called when the header of a file has been read, if it
+  // returns false the file data is skipped (neither stored nor inflated)
+  // and the file is not passed to the delegate
+  virtual bool shouldAccept( File *file ) { return true; }
+  // beginFile is called when the header of a file has been read, if it
+  // returns true the file contents are passed to handleChunk instead of
+  // passing the complete file to handleFile
+  virtual bool beginFile( File *file ) { return false; }
+  // handleChunk is called with consecutive pieces of decompressed data
+  virtual void handleChunk( File *file, const void *data, size_t len ) {}
+  // endFile is called after the last chunk, crcOk is false if CRC32 or
+  // file size don't match the values given in the zip archive
+  virtual void endFile( File *file, bool crcOk ) {}
+};
+
+
+/**
+ *  StreamStats are counters maintained by a Stream (see Stream::stats). 
+ *  Times are measured per piece of data decompressed, so the counters
+ *  may always be kept. Decompression done outside of Stream::scan (by
+ *  worker threads or File::data, see Stream::setThreads/setLazy) is not
+ *  timed.
+ */
+
+struct StreamStats {
+  // compression methods counted
+  enum { Stored, Deflated, Zstd, Lzma, Other, Methods };
+  long		 entries;	// #files found (including rejected files)
+  long		 rejected;	// #files skipped (see StreamDelegate::shouldAccept)
+  long		 unsized;	// #files copied until their data descriptor
+  long		 skipped;	// #bytes skipped searching for a file header
+  long		 reallocs;	// #reallocations of the stream buffer
+  long		 peakBuffer;	// peak size of the stream buffer
+  long		 decodeNs;	// nanoseconds spent decompressing
+  long		 crcNs;		// nanoseconds spent computing CRC32
+  long		 bytes[Methods]; // #bytes of compressed data per method
+  StreamStats( void ) { memset( this, 0, sizeof *this ); }
 };
 
 
@@ -130,13 +314,170 @@ class StreamDelegate {
 class Stream {
   private:
   void			*_buffer;	// opaque buffer for stream data
+  void			*_pipeline;	// opaque worker thread pool
+  void			*_receiver;	// opaque queue of the scanning thread
+  void			*_map;		// archive mapped by scanFile
+  long			 _mapsize;	// size of _map
   long       _bytes_read; // bytes read so far
+  long			 _offset;	// archive offset of the first byte scanned
+  std::atomic<long>	 _resume;	// archive offset after the last file passed
   StreamDelegate	*_delegate;	// delegate to inform
   public:
-  Stream( StreamDelegate &delegate );
+  Stream( StreamDelegate &delegate, 
+          Allocator &allocator = Allocator::standard() );
   ~Stream();
-  void scan( const char *buff, int bufflen );
+  void setThreads( int nthreads, bool ordered = true );
+  void setZeroCopy( bool zerocopy );
+  void setLazy( bool lazy );
+  void scan( const char *buff, long bufflen );
+  void scanMapped( const void *data, long len );
+  void scanFile( const char *path );
+  void setReceiving( int nchunks = 16 );
+  void receive( const char *buff, long bufflen );
+  void finish( void );
   long bytesRead ( void ) const { return _bytes_read; }
+  const StreamStats &stats( void ) const;
+  void setOffset( long offset );
+  long resumeOffset( void ) const;
+};
+
+
+/**
+ *  An Archive gives random access to the files of a zip archive stored 
+ *  on disk. The archive is mapped into memory and its central directory
+ *  is read once, files are then found by name via a hash table:
+ *
+ *    zip::Archive archive( "issue.zip" );
+ *    zip::File *file = archive.extract( "page1.pdf" );
+ *    if ( file ) { ...; delete file; }
+ *
+ *  Archive::extractAll writes all files to a directory using a pool of
+ *  threads, each decompressing its own files from the shared mapping.
+ */
+
+class Archive {
+  private:
+  void			*_map;		// mapped archive
+  long			 _mapsize;	// size of mapping
+  void			*_index;	// opaque index of files
+  public:
+  Archive( const char *path );
+  ~Archive();
+  int count( void ) const;
+  const char *name( int i ) const;
+  int find( const char *name ) const;
+  File *extract( int i ) const;
+  File *extract( const char *name ) const;
+  void extractAll( const char *dir, int nthreads = 0 ) const;
+};
+
+
+/**
+ *  A Reader reads a zip archive from a file and passes it to a Stream.
+ *  Several blocks of the file are read ahead, so reading the file and 
+ *  decompressing it overlap. With ZIP_URING defined (Linux only) the 
+ *  reads are kept in flight by io_uring, otherwise a thread reads ahead:
+ *
+ *    zip::Reader reader( "issue.zip" );
+ *    zip::Stream zipstream( delegate );
+ *    reader.scan( zipstream );	// calls zipstream.finish()
+ *
+ *  Unlike Stream::scanFile the archive is not mapped, so cold data is 
+ *  read in large blocks while the preceeding ones are decompressed.
+ */
+
+class Reader {
+  private:
+  void			*_state;	// opaque reader state
+  public:
+  Reader( const char *path, int nbuffers = 4, long bsize = 1024*1024 );
+  ~Reader();
+  void scan( Stream &stream );
+  const char *backend( void ) const;
+};
+
+
+/**
+ *  An Extractor is a StreamDelegate writing the files found by a Stream to 
+ *  a directory (file names are relative paths, missing directories are 
+ *  created). The file contents are written in chunks as they are 
+ *  decompressed, the files' modification times are set from the archive:
+ *
+ *    zip::Extractor extractor( "/tmp/issue" );
+ *    zip::Stream zipstream( extractor );
+ *    while ( !eof ) zipstream.scan( buff, bufflen );
+ *
+ *  An Exception is thrown (and the file is removed) if a file is corrupt.
+ */
+
+class Extractor : public StreamDelegate {
+  private:
+  char			*_dir;		// directory to write to
+  int			 _fd;		// file currently written
+  char			 _path[1024];	// path name of file currently written
+  public:
+  Extractor( const char *dir );
+  ~Extractor();
+  bool beginFile( File *file );
+  void handleChunk( File *file, const void *data, size_t len );
+  void endFile( File *file, bool crcOk );
+};
+
+
+/**
+ *  A Queue is a StreamDelegate keeping the files found by a Stream until
+ *  they are taken by Queue::next. Hence files may be pulled from a Stream
+ *  instead of being pushed to a delegate:
+ *
+ *    zip::Queue queue;
+ *    zip::Stream zipstream( queue );
+ *    while ( !eof ) {
+ *      zipstream.scan( buff, bufflen );
+ *      while ( zip::File *file = queue.next() ) { ...; delete file; }
+ *    }
+ *
+ *  Files may be queued by other threads (see Stream::setThreads). 
+ *  zipco.hh builds C++20 coroutines (co_await) on a Queue.
+ */
+
+class Queue : public StreamDelegate {
+  private:
+  void			*_state;	// opaque list of files
+  public:
+  Queue( void );
+  ~Queue();
+  void handleFile( File *file );
+  File *next( void );
+  long count( void ) const;
+};
+
+
+/**
+ *  A Writer writes a zip archive to a file descriptor. Files are deflated
+ *  by a pool of threads, large files are split into blocks deflated 
+ *  independently (each primed with the 32K of data preceding it):
+ *
+ *    zip::Writer writer( fd );
+ *    writer.add( "issue.xml", xml, xmllen );
+ *    writer.addFile( "page1.pdf", "/tmp/issue/page1.pdf" );
+ *    writer.finish();	// writes the central directory
+ *
+ *  The output is written sequentially (the file need not be seekable).
+ *  Stored files (compress == false) are read twice, their CRC is written
+ *  in advance so that no data descriptor follows them. Errors are thrown
+ *  by add, addFile or finish.
+ */
+
+class Writer {
+  private:
+  void			*_state;	// opaque writer state
+  public:
+  Writer( int fd, int nthreads = 0, int level = 6 );
+  ~Writer();
+  void add( const char *name, const void *data, long size, 
+            time_t mtime = 0, bool compress = true );
+  void addFile( const char *name, const char *path, bool compress = true );
+  void finish( void );
 };
 
 
@@ -0,0 +1,505 @@
+/** zipbench.cpp
+ *
+ *  Benchmarks of zip::Stream, this file is not part of the NorthLib target.
+ *  To build and run it on Linux or macOS (from this directory):
+ *
+ *    LL=../General/lowlevel
+ *    c++ -O2 -std=c++14 -I$LL -o zipbench zipbench.cpp zip.cpp \
+ *      $LL/fileop.cpp $LL/strext.cpp $LL/argv.cpp -lz -lpthread
+ *    ./zipbench
+ *
+ *  Add -DZIP_ZSTD ... -lzstd and/or -DZIP_LZMA ... -llzma to compare
+ *  the Zstandard and LZMA decoders with zlib. The inflate backend is 
+ *  selected by -DZIP_LIBDEFLATE ... -ldeflate or -DZIP_ZLIB_NG ... -lz-ng,
+ *  build once per backend to compare them. On Linux add -DZIP_URING to
+ *  read ahead using io_uring (zip::Reader).
+ *  The archives scanned are generated in memory. Pass "corpus" as argument
+ *  to only run the corpus benchmark (to compare with a baseline).
+ */
+
+#include <zlib.h>
+#if defined(ZIP_ZSTD)
+#  include <zstd.h>
+#endif
+#if defined(ZIP_LZMA)
+#  include <lzma.h>
+#endif
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include "zip.hh"
+
+namespace {
+
+// current time in seconds
+double now( void ) {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void put16( std::string &s, unsigned v )
+  { s += (char)(v & 0xff); s += (char)((v >> 8) & 0xff); }
+void put32( std::string &s, unsigned v )
+  { put16( s, v & 0xffff ); put16( s, v >> 16 ); }
+
+// raw deflate of 'data'
+std::string deflated( const std::string &data ) {
+  z_stream zs;
+  memset( &zs, 0, sizeof zs );
+  deflateInit2( &zs, 6, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY );
+  std::string ret( deflateBound( &zs, data.size() ), '\0' );
+  zs.next_in = (Bytef *) data.data();
+  zs.avail_in = (uInt) data.size();
+  zs.next_out = (Bytef *) &ret[0];
+  zs.avail_out = (uInt) ret.size();
+  deflate( &zs, Z_FINISH );
+  ret.resize( zs.total_out );
+  deflateEnd( &zs );
+  return ret;
+}
+
+#if defined(ZIP_ZSTD)
+// Zstandard frame of 'data'
+std::string zstdCompressed( const std::string &data ) {
+  std::string ret( ZSTD_compressBound( data.size() ), '\0' );
+  ret.resize( ZSTD_compress( &ret[0], ret.size(), data.data(), data.size(), 
+                             3 ) );
+  return ret;
+}
+#endif
+
+#if defined(ZIP_LZMA)
+// zip LZMA stream of 'data' (version, properties, LZMA1 with end marker)
+std::string lzmaCompressed( const std::string &data ) {
+  lzma_options_lzma opt;
+  lzma_lzma_preset( &opt, 6 );
+  lzma_filter filters[2] = 
+    { { LZMA_FILTER_LZMA1, &opt }, { LZMA_VLI_UNKNOWN, 0 } };
+  uint8_t props[5];
+  lzma_properties_encode( filters, props );
+  std::string ret;
+  put16( ret, 0x0409 ); put16( ret, 5 );
+  ret.append( (const char *) props, 5 );
+  size_t hlen = ret.size();
+  ret.resize( hlen + data.size() + data.size() / 2 + 1024 );
+  lzma_stream ls = LZMA_STREAM_INIT;
+  if ( lzma_raw_encoder( &ls, filters ) != LZMA_OK )
+    throw zip::Exception( "liblzma: lzma_raw_encoder failed" );
+  ls.next_in = (const uint8_t *) data.data();
+  ls.avail_in = data.size();
+  ls.next_out = (uint8_t *) &ret[hlen];
+  ls.avail_out = ret.size() - hlen;
+  lzma_ret lret = lzma_code( &ls, LZMA_FINISH );
+  ret.resize( hlen + ls.total_out );
+  lzma_end( &ls );
+  if ( lret != LZMA_STREAM_END ) 
+    throw zip::Exception( "liblzma: lzma_code failed" );
+  return ret;
+}
+#endif
+
+// 'data' compressed by 'method'
+std::string compressed( int method, const std::string &data ) {
+  switch ( method ) {
+#if defined(ZIP_ZSTD)
+    case 93: return zstdCompressed( data );
+#endif
+#if defined(ZIP_LZMA)
+    case 14: return lzmaCompressed( data );
+#endif
+    case 0: return data;
+    default: return deflated( data );
+} }
+
+// appends a local file header and the 'data' compressed by 'method' 
+// (deflated by default) to 'zip', CRC and sizes are written to a data 
+// descriptor if 'descriptor' is true
+void addEntry( std::string &zip, const std::string &name,
+               const std::string &data, int method = 8, 
+               bool descriptor = false ) {
+  std::string cdata = compressed( method, data );
+  unsigned crc = (unsigned) crc32( 0L, (const Bytef *) data.data(),
+                                   (uInt) data.size() );
+  put32( zip, 0x04034b50 ); put16( zip, 20 ); 
+  // LZMA: end marker used
+  put16( zip, ((method == 14)? 2 : 0) | (descriptor? 8 : 0) );
+  put16( zip, method ); put16( zip, 0 ); put16( zip, 0 );
+  put32( zip, descriptor? 0 : crc );
+  put32( zip, descriptor? 0 : (unsigned) cdata.size() ); 
+  put32( zip, descriptor? 0 : (unsigned) data.size() );
+  put16( zip, (unsigned) name.size() ); put16( zip, 0 );
+  zip += name;
+  zip += cdata;
+  if ( descriptor ) {
+    put32( zip, 0x08074b50 ); put32( zip, crc ); 
+    put32( zip, (unsigned) cdata.size() ); put32( zip, (unsigned) data.size() );
+} }
+
+// some JSON-like text of 'len' bytes
+std::string text( int len, unsigned seed ) {
+  static const char *words[] = { "\"id\":", "\"title\":", "\"page\"", ",",
+    "{", "}", "[", "]", "issue", "article", "author", " ", "2020", "\n" };
+  std::string ret;
+  while ( (int) ret.size() < len ) {
+    seed = seed * 1103515245 + 12345;
+    ret += words[(seed >> 24) % 14];
+  }
+  ret.resize( len );
+  return ret;
+}
+
+class CountingDelegate : public zip::StreamDelegate {
+  public:
+  long nfiles = 0, nbytes = 0;
+  void handleFile( zip::File *file )
+    { nfiles++; nbytes += file->size(); delete file; }
+};
+
+/**
+ *  Many small entries: compares the cost per entry of allocating a new
+ *  inflate state (inflateInit2/inflateEnd) with resetting a persistent
+ *  one (inflateReset) and measures zip::Stream::scan. Like zip::Stream 
+ *  inflate is called with Z_NO_FLUSH, hence zlib allocates its window.
+ */
+void smallEntries( int nentries ) {
+  std::string zip;
+  std::vector<std::string> cdata;
+  for ( int i = 0; i < nentries; i++ ) {
+    std::string data = text( 50 + (i * 37) % 250, i );
+    addEntry( zip, "e/" + std::to_string( i ) + ".json", data );
+    cdata.push_back( deflated( data ) );
+  }
+  static unsigned char out[4096];
+  z_stream zs;
+  double t0 = now();
+  for ( auto &c: cdata ) {
+    memset( &zs, 0, sizeof zs );
+    inflateInit2( &zs, -MAX_WBITS );
+    zs.next_in = (Bytef *) c.data(); zs.avail_in = (uInt) c.size();
+    zs.next_out = out; zs.avail_out = sizeof out;
+    inflate( &zs, Z_NO_FLUSH );
+    inflateEnd( &zs );
+  }
+  double tinit = now() - t0;
+  memset( &zs, 0, sizeof zs );
+  inflateInit2( &zs, -MAX_WBITS );
+  t0 = now();
+  for ( auto &c: cdata ) {
+    inflateReset( &zs );
+    zs.next_in = (Bytef *) c.data(); zs.avail_in = (uInt) c.size();
+    zs.next_out = out; zs.avail_out = sizeof out;
+    inflate( &zs, Z_NO_FLUSH );
+  }
+  double treset = now() - t0;
+  inflateEnd( &zs );
+  CountingDelegate delegate;
+  zip::Stream stream( delegate );
+  t0 = now();
+  for ( size_t pos = 0; pos < zip.size(); pos += 64*1024 ) {
+    size_t len = zip.size() - pos;
+    stream.scan( zip.data() + pos, (int)( (len > 64*1024)? 64*1024 : len ) );
+  }
+  double tscan = now() - t0;
+  printf( "small entries (%d, %.1f MB compressed):\n", nentries,
+          zip.size() / 1e6 );
+  printf( "  inflateInit2/End per entry: %6.2f us/entry\n",
+          tinit * 1e6 / nentries );
+  printf( "  inflateReset per entry:     %6.2f us/entry (%.2f us saved)\n",
+          treset * 1e6 / nentries, (tinit - treset) * 1e6 / nentries );
+  printf( "  zip::Stream::scan:          %6.2f us/entry, %.0f entries/s\n",
+          tscan * 1e6 / delegate.nfiles, delegate.nfiles / tscan );
+}
+
+/**
+ *  Compression methods: scans archives of 'nentries' text files of 
+ *  'size' bytes with each compression method available and reports the
+ *  compression ratio and the throughput (uncompressed MB/s).
+ */
+void methods( int nentries, int size ) {
+  static const struct { int method; const char *name; } ms[] = {
+    { 0, "stored" }, { 8, "deflate (zlib)" },
+#if defined(ZIP_ZSTD)
+    { 93, "zstd" },
+#endif
+#if defined(ZIP_LZMA)
+    { 14, "lzma" },
+#endif
+  };
+  std::vector<std::string> data;
+  for ( int i = 0; i < nentries; i++ ) data.push_back( text( size, i ) );
+  printf( "compression methods (%d entries of %d KB):\n", nentries, 
+          size / 1024 );
+  for ( auto &m: ms ) {
+    std::string zip;
+    for ( int i = 0; i < nentries; i++ ) 
+      addEntry( zip, "m/" + std::to_string( i ), data[i], m.method );
+    CountingDelegate delegate;
+    zip::Stream stream( delegate );
+    double t0 = now();
+    for ( size_t pos = 0; pos < zip.size(); pos += 64*1024 ) {
+      size_t len = zip.size() - pos;
+      stream.scan( zip.data() + pos, (long)( (len > 64*1024)? 64*1024 : len ) );
+    }
+    double t = now() - t0;
+    printf( "  %-16s %5.1f%% of size, %7.1f MB/s\n", m.name, 
+            100.0 * zip.size() / ((double) nentries * size),
+            delegate.nbytes / t / 1e6 );
+} }
+
+class LazyDelegate : public zip::StreamDelegate {
+  public:
+  long nfiles = 0, nbytes = 0;
+  void handleFile( zip::File *file )
+    { file->data(); nfiles++; nbytes += file->size(); delete file; }
+};
+
+/**
+ *  Inflate backend: scans deflated text files of 'size' bytes streamed in
+ *  64K pieces, passed as a whole (whole buffer inflate if available) and 
+ *  decompressed by File::data (see Stream::setLazy).
+ */
+void inflateBackend( int nentries, int size ) {
+#if defined(ZIP_LIBDEFLATE)
+  const char *backend = "libdeflate";
+#elif defined(ZIP_ZLIB_NG)
+  const char *backend = "zlib-ng";
+#else
+  const char *backend = "zlib";
+#endif
+  std::string zip;
+  for ( int i = 0; i < nentries; i++ ) 
+    addEntry( zip, "d/" + std::to_string( i ), text( size, i ) );
+  printf( "inflate backend %s (%d entries of %d KB):\n", backend, nentries, 
+          size / 1024 );
+  for ( int mode = 0; mode < 3; mode++ ) {
+    CountingDelegate counting;
+    LazyDelegate lazy;
+    zip::Stream stream( (mode == 2)? (zip::StreamDelegate &) lazy : counting );
+    size_t piece = (mode == 0)? 64*1024 : zip.size();
+    stream.setLazy( mode == 2 );
+    double t0 = now();
+    for ( size_t pos = 0; pos < zip.size(); pos += piece ) {
+      size_t len = zip.size() - pos;
+      stream.scan( zip.data() + pos, (long)( (len > piece)? piece : len ) );
+    }
+    double t = now() - t0;
+    static const char *modes[] = 
+      { "streamed (64K)", "whole archive", "File::data" };
+    printf( "  %-16s %7.1f MB/s\n", modes[mode], 
+            (counting.nbytes + lazy.nbytes) / t / 1e6 );
+} }
+
+/**
+ *  Receiving: passes deflated text files in 16K pieces like a download 
+ *  callback, either to Stream::scan or to Stream::receive (with a 
+ *  scanning thread, see Stream::setReceiving). The receiving thread 
+ *  computes CRC32s of each piece standing in for the work of receiving
+ *  it (e.g. TLS decryption). Reports the time the receiving thread is 
+ *  blocked per MB and the throughput (uncompressed MB/s).
+ */
+void receiving( int nentries, int size ) {
+  std::string zip;
+  for ( int i = 0; i < nentries; i++ ) 
+    addEntry( zip, "r/" + std::to_string( i ), text( size, i ) );
+  printf( "receiving (%d entries of %d KB, 16K pieces):\n", nentries, 
+          size / 1024 );
+  for ( int nchunks = 0; nchunks <= 64; nchunks = nchunks? nchunks * 4 : 4 ) {
+    CountingDelegate delegate;
+    zip::Stream stream( delegate );
+    if ( nchunks ) stream.setReceiving( nchunks );
+    double t0 = now(), tblocked = 0;
+    for ( size_t pos = 0; pos < zip.size(); pos += 16*1024 ) {
+      size_t len = zip.size() - pos;
+      len = (len > 16*1024)? 16*1024 : len;
+      for ( int i = 0; i < 64; i++ )
+        crc32( 0L, (const Bytef *) zip.data() + pos, (uInt) len );
+      double t1 = now();
+      stream.receive( zip.data() + pos, (long) len );
+      tblocked += now() - t1;
+    }
+    stream.finish();
+    double t = now() - t0;
+    char name[32];
+    if ( nchunks ) snprintf( name, sizeof name, "receive (%d)", nchunks );
+    else snprintf( name, sizeof name, "scan" );
+    printf( "  %-16s %8.1f us blocked/MB, %7.1f MB/s\n", name, 
+            tblocked * 1e6 / (zip.size() / 1e6), delegate.nbytes / t / 1e6 );
+} }
+
+/**
+ *  A CountingAllocator counts the allocations (and reallocations) of a 
+ *  Stream and the peak of storage in use.
+ */
+class CountingAllocator : public zip::Allocator {
+  public:
+  std::atomic<long> nallocs{0}, inuse{0}, peak{0};
+  void *alloc( size_t size ) {
+    nallocs++;
+    long n = (inuse += size), p = peak;
+    while ( (n > p) && !peak.compare_exchange_weak( p, n ) ) {}
+    return malloc( size );
+  }
+  void release( void *ptr, size_t size ) { inuse -= size; free( ptr ); }
+  // like the standard Allocator
+  void *resize( void *ptr, size_t size, size_t nsize ) {
+    nallocs++;
+    long n = (inuse += (long) nsize - (long) size), p = peak;
+    while ( (n > p) && !peak.compare_exchange_weak( p, n ) ) {}
+    return realloc( ptr, nsize );
+  }
+};
+
+/**
+ *  On disk: scans an archive of stored and deflated text files written to
+ *  a temporary file, read in 64K pieces and passed to Stream::scan or 
+ *  mapped by Stream::scanFile. Both eagerly and lazily (the files are 
+ *  passed compressed and only their sizes are looked at). Reports the 
+ *  throughput (MB/s of archive) and the peak of storage of the Stream.
+ */
+void onDisk( int nentries, int size ) {
+  std::string zip;
+  for ( int i = 0; i < nentries; i++ ) 
+    addEntry( zip, "f/" + std::to_string( i ), text( size, i ), 
+              (i % 2)? 8 : 0 );
+  char path[] = "/tmp/zipbenchXXXXXX";
+  int fd = mkstemp( path );
+  if ( (fd < 0) || (write( fd, zip.data(), zip.size() ) != (long) zip.size()) )
+    throw zip::Exception( "onDisk: can't write archive" );
+  close( fd );
+  printf( "on disk (%d entries of %d KB, half stored, %.1f MB):\n", 
+          nentries, size / 1024, zip.size() / 1e6 );
+  for ( int mode = 0; mode < 4; mode++ ) {
+    bool mapped = mode & 1, lazy = mode & 2;
+    CountingAllocator allocator;
+    CountingDelegate delegate;
+    zip::Stream stream( delegate, allocator );
+    stream.setLazy( lazy );
+    double t0 = now();
+    if ( mapped ) stream.scanFile( path );
+    else {
+      static char buff[64*1024];
+      long n;
+      fd = open( path, O_RDONLY );
+      while ( (n = read( fd, buff, sizeof buff )) > 0 ) stream.scan( buff, n );
+      close( fd );
+    }
+    double t = now() - t0;
+    printf( "  %-6s %-16s %8.1f MB/s %7.2f MB peak\n", lazy? "lazy" : "eager",
+            mapped? "scanFile" : "read + scan", zip.size() / t / 1e6,
+            allocator.peak / 1e6 );
+  }
+  unlink( path );
+}
+
+/**
+ *  Cold cache: scans a deflated archive written to a temporary file after
+ *  evicting it from the page cache (POSIX_FADV_DONTNEED), read in 1M 
+ *  pieces by read() and scanned, or by a zip::Reader reading ahead. 
+ *  Reports the throughput (MB/s of archive).
+ */
+void coldCache( int nentries, int size ) {
+  std::string zip;
+  for ( int i = 0; i < nentries; i++ ) 
+    addEntry( zip, "c/" + std::to_string( i ), text( size, i ) );
+  char path[] = "/tmp/zipbenchXXXXXX";
+  int fd = mkstemp( path );
+  if ( (fd < 0) || (write( fd, zip.data(), zip.size() ) != (long) zip.size()) )
+    throw zip::Exception( "coldCache: can't write archive" );
+  fsync( fd );
+  close( fd );
+  printf( "cold cache (%d entries of %d KB, %.1f MB):\n", nentries, 
+          size / 1024, zip.size() / 1e6 );
+  for ( int mode = 0; mode < 2; mode++ ) {
+    CountingDelegate delegate;
+    zip::Stream stream( delegate );
+    fd = open( path, O_RDONLY );
+    posix_fadvise( fd, 0, 0, POSIX_FADV_DONTNEED );
+    double t0 = now();
+    const char *name = "read + scan";
+    if ( mode == 0 ) {
+      static char buff[1024*1024];
+      long n;
+      while ( (n = read( fd, buff, sizeof buff )) > 0 ) stream.scan( buff, n );
+    }
+    else {
+      zip::Reader reader( path );
+      reader.scan( stream );
+      name = reader.backend();
+    }
+    double t = now() - t0;
+    close( fd );
+    printf( "  %-16s %8.1f MB/s\n", name, zip.size() / t / 1e6 );
+  }
+  unlink( path );
+}
+
+/**
+ *  Corpus: scans archives of many tiny and of few huge entries, stored
+ *  and deflated, with and without data descriptors, passed to 
+ *  zip::Stream::scan in chunks of 1K to 4M. Reports the throughput 
+ *  (archive MB/s), entries/s, the allocations per entry and the peak of
+ *  storage allocated by the Stream during the run.
+ */
+void corpus( void ) {
+  static const struct { const char *name; int nentries, size; } corpora[] = {
+    { "tiny", 20000, 0 }, { "huge", 4, 16*1024*1024 } };
+  printf( "corpus (MB/s of archive, entries/s, allocs/entry, peak MB):\n" );
+  for ( auto &c: corpora ) {
+    std::vector<std::string> data;
+    for ( int i = 0; i < c.nentries; i++ ) 
+      data.push_back( text( c.size? c.size : 20 + (i * 37) % 400, i ) );
+    for ( int variant = 0; variant < 4; variant++ ) {
+      int method = (variant & 1)? 8 : 0;
+      bool descriptor = (variant & 2) != 0;
+      std::string zip;
+      for ( int i = 0; i < c.nentries; i++ ) 
+        addEntry( zip, "c/" + std::to_string( i ), data[i], method, 
+                  descriptor );
+      printf( "  %s %s%s (%d entries, %.1f MB):\n", c.name,
+              method? "deflated" : "stored", descriptor? " + descriptor" : "",
+              c.nentries, zip.size() / 1e6 );
+      for ( size_t chunk = 1024; chunk <= 4*1024*1024; chunk *= 4 ) {
+        CountingAllocator allocator;
+        CountingDelegate delegate;
+        zip::Stream stream( delegate, allocator );
+        double t0 = now();
+        for ( size_t pos = 0; pos < zip.size(); pos += chunk ) {
+          size_t len = zip.size() - pos;
+          stream.scan( zip.data() + pos, (long)( (len > chunk)? chunk : len ) );
+        }
+        double t = now() - t0;
+        if ( delegate.nfiles != c.nentries ) 
+          throw zip::Exception( "corpus: files missing" );
+        printf( "    %4zu%s chunks %8.1f MB/s %10.0f entries/s %5.2f allocs "
+                "%7.2f MB peak\n", 
+                (chunk < 1024*1024)? chunk / 1024 : chunk / (1024*1024),
+                (chunk < 1024*1024)? "K" : "M", zip.size() / t / 1e6, 
+                delegate.nfiles / t, 
+                (double) allocator.nallocs / delegate.nfiles,
+                allocator.peak / 1e6 );
+} } } }
+
+} // namespace
+
+int main( int argc, char **argv ) {
+  try { 
+    if ( (argc < 2) || strcmp( argv[1], "corpus" ) ) {
+      smallEntries( 50000 ); 
+      methods( 64, 1024*1024 ); 
+      inflateBackend( 64, 1024*1024 );
+      receiving( 64, 1024*1024 );
+      onDisk( 64, 1024*1024 );
+      coldCache( 64, 1024*1024 );
+    }
+    corpus();
+  }
+  catch ( const zip::Exception &e ) {
+    printf( "Exception: %s\n", e.what() );
+    return 1;
+  }
+  return 0;
+}
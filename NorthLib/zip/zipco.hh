@@ -0,0 +1,137 @@
+/** zipco.hh
+ *
+ *  Defines zip::AsyncStream, a zip::Stream used by C++20 coroutines.
+ *  This header needs C++20, zip.hh and zip.cpp only need C++14.
+ *
+ *  A producer coroutine feeds the data of a zip archive as it is received,
+ *  a consumer coroutine takes the files found:
+ *
+ *    zip::AsyncStream zipstream;
+ *
+ *    task produce( ... ) {
+ *      while ( !eof ) {
+ *        // receive data into buff (length bufflen), e.g. co_await'ing I/O
+ *        co_await zipstream.feed( buff, bufflen );
+ *      }
+ *      zipstream.close();
+ *    }
+ *
+ *    task consume( ... ) {
+ *      while ( zip::File *file = co_await zipstream.next() ) {
+ *        ...
+ *        delete file;
+ *      }
+ *    }
+ *
+ *  feed scans the data and suspends the producer if files are found while
+ *  the consumer waits (the consumer is resumed) or if 'maxFiles' files
+ *  are queued. next suspends the consumer while no file is queued and
+ *  resumes the producer if it waits. So neither coroutine blocks a thread
+ *  and many AsyncStreams may be served by a few threads. The coroutines
+ *  of an AsyncStream must not run concurrently (i.e. both are resumed by
+ *  the same thread or strand of an executor). After close next returns
+ *  the files left and then 0.
+ *
+ *  Errors of the archive are thrown by feed resp. close. They end the 
+ *  stream, the waiting consumer is resumed and next throws the error after 
+ *  the files found before it have been taken.
+ */
+
+#ifndef __zipco_h
+#define __zipco_h
+
+#include <coroutine>
+#include <exception>
+#include "zip.hh"
+
+namespace zip {
+
+class AsyncStream {
+
+  private:
+  Queue			 _queue;	// files found
+  Stream		 _stream;	// Stream scanning the data fed
+  long			 _maxFiles;	// max #files queued before feed suspends
+  int			 _closed;	// no more data is fed
+  std::coroutine_handle<> _producer;	// producer waiting in feed
+  std::coroutine_handle<> _consumer;	// consumer waiting in next
+  std::exception_ptr _error;	// error thrown by _stream
+
+  // returns the coroutine waiting in 'h' to transfer control to
+  static std::coroutine_handle<> take( std::coroutine_handle<> &h ) {
+    std::coroutine_handle<> ret = h;
+    h = nullptr;
+    return ret? ret : std::noop_coroutine();
+  }
+
+  // records the current exception, ends the stream and resumes the 
+  // waiting consumer
+  void fail( void ) {
+    _error = std::current_exception();
+    _closed = 1;
+    if ( _consumer ) take( _consumer ).resume();
+  }
+
+  public:
+
+  // the awaitable returned by feed
+  class Feed {
+    AsyncStream	*_s;
+    const char	*_buff;
+    long	 _len;
+    public:
+    Feed( AsyncStream *s, const char *buff, long len )
+      { _s = s; _buff = buff; _len = len; }
+    bool await_ready( void ) {
+      try { _s->_stream.scan( _buff, _len ); }
+      catch ( ... ) { _s->fail(); throw; }
+      long n = _s->_queue.count();
+      return (n == 0) || (!_s->_consumer && (n < _s->_maxFiles));
+    }
+    std::coroutine_handle<> await_suspend( std::coroutine_handle<> h )
+      { _s->_producer = h; return take( _s->_consumer ); }
+    void await_resume( void ) {}
+  };
+
+  // the awaitable returned by next
+  class Next {
+    AsyncStream	*_s;
+    public:
+    Next( AsyncStream *s ) { _s = s; }
+    bool await_ready( void ) { return _s->_closed || _s->_queue.count(); }
+    std::coroutine_handle<> await_suspend( std::coroutine_handle<> h )
+      { _s->_consumer = h; return take( _s->_producer ); }
+    File *await_resume( void ) {
+      File *file = _s->_queue.next();
+      if ( !file && _s->_error ) std::rethrow_exception( _s->_error );
+      return file;
+    }
+  };
+
+  AsyncStream( long maxFiles = 16,
+               Allocator &allocator = Allocator::standard() )
+    : _stream( _queue, allocator ) { _maxFiles = maxFiles; _closed = 0; }
+
+  // the Stream scanning the data (e.g. to call setThreads or stats)
+  Stream &stream( void ) { return _stream; }
+
+  // scans the data, co_await it
+  Feed feed( const char *buff, long bufflen )
+    { return Feed( this, buff, bufflen ); }
+
+  // returns the next file or 0 after close, co_await it
+  Next next( void ) { return Next( this ); }
+
+  // ends the data, resumes the waiting consumer
+  void close( void ) {
+    try { _stream.finish(); }
+    catch ( ... ) { fail(); throw; }
+    _closed = 1;
+    if ( _consumer ) take( _consumer ).resume();
+  }
+
+}; // class AsyncStream
+
+}; // namespace zip
+
+#endif // __zipco_h
@@ -9,6 +9,304 @@
 #import <XCTest/XCTest.h>
 #include "NorthLib/strext.h"
 #include "NorthLib/fileop.h"
+#include "../NorthLib/zip/zip.hh"
+#if __cplusplus >= 202002L
+#include "../NorthLib/zip/zipco.hh"
+#endif
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ftw.h>
+
+// collects the files found by a zip::Stream
+struct ZipCollector: zip::StreamDelegate {
+  std::string names, data;
+  void handleFile(zip::File *file) {
+    names += file->name();
+    names += ";";
+    data.append((const char *) file->data(), file->size());
+    delete file;
+  }
+};
+
+// CRC32 of 'data' computed bit by bit
+static unsigned crc32Bitwise(const std::string &data) {
+  unsigned crc = ~0u;
+  for (unsigned char c: data) {
+    crc ^= c;
+    for (int k = 0; k < 8; k++) 
+      crc = (crc & 1)? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+  }
+  return ~crc;
+}
+
+// appends 16/32 bit little endian numbers to 'out'
+static void put16(std::string &out, unsigned n) { 
+  out += (char) (n & 0xff); 
+  out += (char) ((n >> 8) & 0xff); 
+}
+static void put32(std::string &out, unsigned n) 
+  { put16(out, n & 0xffff); put16(out, n >> 16); }
+
+static void put64(std::string &out, uint64_t n) 
+  { put32(out, (unsigned) n); put32(out, (unsigned) (n >> 32)); }
+
+// a file of a zip archive built by the tests (for the central directory)
+struct ZipEntry {
+  std::string name;
+  unsigned crc;
+  uint64_t size, csize, offset;
+  int method;
+};
+
+// appends a file to the zip archive 'zip', CRC and sizes are in its header 
+// or (if 'descriptor') in a data descriptor following the data. Deflated 
+// files ('method' 8) consist of uncompressed deflate blocks. With 'zip64'
+// the sizes are in a Zip64 extra field (resp. a Zip64 data descriptor).
+static ZipEntry addFile(std::string &zip, const std::string &name, 
+                        const std::string &data, int method = 0, 
+                        bool descriptor = false, bool zip64 = false) {
+  std::string cdata;
+  if (method == 8) {
+    size_t pos = 0;
+    do {
+      unsigned len = (unsigned) std::min(data.size() - pos, (size_t) 0xffff);
+      cdata += (char) ((pos + len == data.size())? 1 : 0);
+      put16(cdata, len); put16(cdata, ~len & 0xffff);
+      cdata.append(data, pos, len);
+      pos += len;
+    } while (pos < data.size());
+  }
+  else cdata = data;
+  unsigned crc = crc32Bitwise(data), size = (unsigned) data.size(), 
+           csize = (unsigned) cdata.size();
+  ZipEntry entry = { name, crc, size, csize, zip.size(), method };
+  put32(zip, 0x04034b50); put16(zip, 20); put16(zip, descriptor? 8 : 0);
+  put16(zip, method); put16(zip, 0); put16(zip, 0x21);
+  put32(zip, descriptor? 0 : crc); 
+  if (zip64) { put32(zip, 0xffffffff); put32(zip, 0xffffffff); }
+  else { put32(zip, descriptor? 0 : csize); put32(zip, descriptor? 0 : size); }
+  put16(zip, (unsigned) name.size()); put16(zip, zip64? 20 : 0);
+  zip += name;
+  if (zip64) {
+    put16(zip, 1); put16(zip, 16);
+    put64(zip, descriptor? 0 : size); put64(zip, descriptor? 0 : csize);
+  }
+  zip += cdata;
+  if (descriptor) {
+    put32(zip, 0x08074b50); put32(zip, crc); 
+    if (zip64) { put64(zip, csize); put64(zip, size); }
+    else { put32(zip, csize); put32(zip, size); }
+  }
+  return entry;
+}
+
+// appends the central directory of 'entries' to 'zip', sizes and offsets 
+// of 0xffffffff and more are written to a Zip64 extra field
+static void addCentral(std::string &zip, const std::vector<ZipEntry> &entries) {
+  size_t start = zip.size();
+  for (const ZipEntry &e: entries) {
+    std::string extra;
+    uint64_t vals[3] = { e.size, e.csize, e.offset };
+    for (uint64_t v: vals) if (v >= 0xffffffff) put64(extra, v);
+    put32(zip, 0x02014b50); put16(zip, 45); put16(zip, 45); put16(zip, 0);
+    put16(zip, e.method); put16(zip, 0); put16(zip, 0x21); put32(zip, e.crc);
+    put32(zip, (e.csize >= 0xffffffff)? 0xffffffff : (unsigned) e.csize);
+    put32(zip, (e.size >= 0xffffffff)? 0xffffffff : (unsigned) e.size);
+    put16(zip, (unsigned) e.name.size()); 
+    put16(zip, extra.empty()? 0 : 4 + (unsigned) extra.size()); 
+    put16(zip, 0); put16(zip, 0); put16(zip, 0); put32(zip, 0);
+    put32(zip, (e.offset >= 0xffffffff)? 0xffffffff : (unsigned) e.offset);
+    zip += e.name;
+    if (!extra.empty()) { 
+      put16(zip, 1); put16(zip, (unsigned) extra.size()); 
+      zip += extra; 
+    }
+  }
+  unsigned size = (unsigned) (zip.size() - start);
+  put32(zip, 0x06054b50); put16(zip, 0); put16(zip, 0); 
+  put16(zip, (unsigned) entries.size()); put16(zip, (unsigned) entries.size());
+  put32(zip, size); put32(zip, (unsigned) start);
+  put16(zip, 0);
+}
+
+// writes 'data' to file 'path'
+static void writeContents(const std::string &path, const std::string &data) {
+  int fd = open(path.c_str(), O_CREAT|O_TRUNC|O_WRONLY, 0644);
+  if (fd >= 0) { write(fd, data.data(), data.size()); close(fd); }
+}
+
+// path of 'name' in the temporary directory
+static std::string tmpPath(const char *name) {
+  return std::string(NSTemporaryDirectory().UTF8String) + "/" + name;
+}
+
+// removes 'path' and everything below it
+static void removeAll(const std::string &path) {
+  nftw(path.c_str(), [](const char *p, const struct stat *, int, struct FTW *)
+       { return remove(p); }, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+// contents of file 'path'
+static std::string fileContents(const std::string &path) {
+  std::string ret;
+  char buff[4096];
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return "<missing>";
+  for (ssize_t n; (n = read(fd, buff, sizeof buff)) > 0; ) ret.append(buff, n);
+  close(fd);
+  return ret;
+}
+
+// whether 'path' is a directory
+static bool isDirectory(const std::string &path) {
+  stat_t st;
+  return (stat_read(&st, path.c_str()) == 0) && stat_isdir(&st);
+}
+
+// collects the files found by a zip::Stream in chunks
+struct ChunkCollector: zip::StreamDelegate {
+  std::string names, data;
+  long chunks = 0, crcErrors = 0;
+  bool beginFile(zip::File *file) {
+    names += file->name();
+    names += ";";
+    return true;
+  }
+  void handleChunk(zip::File *file, const void *buff, size_t len) {
+    data.append((const char *) buff, len);
+    chunks++;
+  }
+  void endFile(zip::File *file, bool crcOk) { if (!crcOk) crcErrors++; }
+};
+
+#if __cplusplus >= 202002L
+// a coroutine started immediately and destroyed when it returns
+struct ZipTask {
+  struct promise_type {
+    ZipTask get_return_object() { return {}; }
+    std::suspend_never initial_suspend() { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+// takes the files of 'stream' until it is closed
+static ZipTask consumeZip(zip::AsyncStream &stream, ZipCollector &collector,
+                          bool &failed) {
+  try { 
+    while (zip::File *file = co_await stream.next()) 
+      collector.handleFile(file); 
+  }
+  catch (zip::Exception &) { failed = true; }
+}
+
+// feeds 'zip' to 'stream' in pieces of 'len' bytes
+static ZipTask produceZip(zip::AsyncStream &stream, const std::string &zip,
+                          size_t len, bool &failed) {
+  try {
+    for (size_t i = 0; i < zip.size(); i += len)
+      co_await stream.feed(zip.data() + i, 
+                           (long) std::min(len, zip.size() - i));
+    stream.close();
+  }
+  catch (zip::Exception &) { failed = true; }
+}
+#endif
+
+#if defined(ZIP_LZMA)
+// zip archive of two LZMA compressed files (with end marker) written by
+// Python's zipfile, a.txt: 1000 lines "line <i> of an lzma file", b.txt
+static const unsigned char lzmaZip[] = {
+  0x50, 0x4b, 0x03, 0x04, 0x3f, 0x00, 0x02, 0x00, 0x0e, 0x00, 0xa4, 0xbd,
+  0x50, 0x5d, 0x84, 0xfe, 0x23, 0x3b, 0x05, 0x03, 0x00, 0x00, 0x3a, 0x61,
+  0x00, 0x00, 0x05, 0x00, 0x00, 0x00, 0x61, 0x2e, 0x74, 0x78, 0x74, 0x09,
+  0x04, 0x05, 0x00, 0x5d, 0x00, 0x00, 0x80, 0x00, 0x00, 0x36, 0x1a, 0x4a,
+  0x1f, 0x08, 0xa0, 0x26, 0x03, 0x4d, 0x06, 0x9d, 0xf0, 0x03, 0xdc, 0xd7,
+  0xd2, 0x3e, 0x58, 0x1b, 0xd7, 0x1b, 0x64, 0x88, 0x61, 0xac, 0x97, 0xaa,
+  0xbc, 0x81, 0x4d, 0x0e, 0x09, 0xbe, 0x4f, 0x98, 0xf9, 0xb5, 0x63, 0x1d,
+  0x92, 0xa4, 0xba, 0xf2, 0x74, 0x3d, 0x4c, 0x74, 0x91, 0x0d, 0x87, 0x0a,
+  0x69, 0xcd, 0x95, 0x32, 0x8c, 0xd1, 0xea, 0xc9, 0x56, 0xe8, 0x7d, 0x9d,
+  0x47, 0x87, 0xba, 0xf5, 0xb3, 0x21, 0xc1, 0x9a, 0x86, 0xc8, 0x50, 0x8f,
+  0xe2, 0x15, 0xf2, 0x54, 0x02, 0xb5, 0x5d, 0x93, 0x4d, 0xfe, 0x8d, 0x21,
+  0x4a, 0xf0, 0x3d, 0x8e, 0xdc, 0xd2, 0x48, 0xcb, 0x2f, 0xe6, 0xd9, 0x66,
+  0x8f, 0x82, 0x90, 0x63, 0x68, 0x0e, 0x24, 0x24, 0xbf, 0xd9, 0x34, 0xbb,
+  0x67, 0x7e, 0xca, 0x3d, 0x50, 0x51, 0x4d, 0x04, 0xd6, 0xdf, 0xd3, 0x69,
+  0xa9, 0xc0, 0xd0, 0xc4, 0xc0, 0x96, 0x2b, 0xb6, 0x90, 0x1f, 0xe1, 0x63,
+  0x2e, 0xa2, 0xd9, 0xff, 0xaf, 0x72, 0x22, 0xec, 0x29, 0xd0, 0x6d, 0xf9,
+  0x7e, 0x0f, 0x3b, 0x82, 0x44, 0x90, 0x77, 0x15, 0x1c, 0x80, 0x1f, 0xfa,
+  0xb6, 0x6e, 0xf7, 0x34, 0x07, 0x47, 0xed, 0x97, 0x9e, 0xe6, 0x7a, 0x1b,
+  0x00, 0x0e, 0x6a, 0xec, 0x9e, 0xc3, 0x60, 0x7a, 0xd3, 0x18, 0x9d, 0x73,
+  0x59, 0x7b, 0xc7, 0x26, 0x93, 0x59, 0xdc, 0x57, 0x82, 0x0e, 0x0a, 0x17,
+  0xc9, 0x83, 0x3b, 0xbb, 0x9a, 0x4a, 0xf6, 0xf6, 0xc7, 0x86, 0x89, 0x4d,
+  0xd7, 0xf1, 0x83, 0x5d, 0x57, 0xa5, 0xd1, 0x51, 0xa4, 0x34, 0x5e, 0x31,
+  0xf6, 0x5d, 0x2b, 0x44, 0x58, 0x93, 0x3b, 0xb7, 0x0f, 0x7a, 0x36, 0x7d,
+  0x39, 0xbd, 0x43, 0x79, 0x6f, 0x4d, 0x96, 0x8d, 0x07, 0x8f, 0xc4, 0x00,
+  0x97, 0xf4, 0xcf, 0x4c, 0xdd, 0x57, 0xfb, 0xe3, 0xdf, 0xd2, 0x53, 0xfb,
+  0x78, 0xad, 0x31, 0xf4, 0x31, 0x17, 0x46, 0xe4, 0x14, 0x0f, 0x04, 0xc5,
+  0x3b, 0xa9, 0x4f, 0x1f, 0x46, 0x97, 0x6d, 0xd2, 0x45, 0x0b, 0x9c, 0xc0,
+  0x01, 0xb8, 0xca, 0x04, 0xa3, 0x3e, 0x14, 0x45, 0x23, 0xca, 0x03, 0xf8,
+  0x79, 0xae, 0x28, 0x49, 0x1c, 0x64, 0x3a, 0x16, 0xa1, 0x27, 0x8a, 0x9a,
+  0xe0, 0xb2, 0x96, 0xaa, 0x25, 0x90, 0xe6, 0x37, 0x07, 0x3b, 0x43, 0xe6,
+  0x5f, 0x81, 0xb5, 0x80, 0x8d, 0x98, 0xb5, 0x0c, 0x4c, 0xb8, 0x94, 0x68,
+  0x4c, 0xca, 0xd5, 0xf2, 0x9d, 0x3b, 0xeb, 0x9d, 0x1c, 0x05, 0xa6, 0x87,
+  0x64, 0x70, 0x22, 0x03, 0x38, 0xd4, 0xfc, 0x51, 0x5d, 0x10, 0x29, 0xc2,
+  0xf9, 0x8f, 0xd5, 0x4e, 0xf4, 0xda, 0x3e, 0x71, 0xba, 0x17, 0xa6, 0xf9,
+  0x18, 0x15, 0xfc, 0x07, 0x3a, 0x5f, 0xd2, 0xc0, 0xa1, 0x02, 0x42, 0x43,
+  0x51, 0xa8, 0x45, 0x52, 0xe8, 0xdf, 0x14, 0xea, 0x96, 0xcd, 0x7c, 0xa1,
+  0x8a, 0x23, 0xba, 0xec, 0xb5, 0xfd, 0x3c, 0xc2, 0x22, 0x1a, 0x12, 0x58,
+  0x88, 0x84, 0xdf, 0x0e, 0xc0, 0xf5, 0x94, 0x07, 0xe3, 0x00, 0x1c, 0x50,
+  0x43, 0x13, 0xa8, 0x9f, 0x09, 0x83, 0x05, 0x05, 0xb2, 0x3f, 0x7f, 0xa0,
+  0x1f, 0x7b, 0xe3, 0xf6, 0x31, 0x03, 0x1a, 0x12, 0x6b, 0x22, 0xc3, 0x6d,
+  0xd2, 0x90, 0xb6, 0x0d, 0x77, 0x28, 0x03, 0xff, 0xee, 0xbe, 0x7d, 0xe2,
+  0xd7, 0x19, 0x07, 0x65, 0x01, 0xd1, 0xba, 0x75, 0xf7, 0x75, 0x84, 0x08,
+  0xd6, 0x1f, 0x08, 0x20, 0xbf, 0x51, 0x57, 0x4f, 0xb5, 0xe7, 0x0d, 0x59,
+  0x75, 0x44, 0x2d, 0x8f, 0x2d, 0x05, 0x9c, 0x57, 0x04, 0xee, 0x84, 0x1d,
+  0x05, 0x7a, 0x9c, 0x23, 0xfe, 0xe5, 0xf6, 0xbc, 0x93, 0xe9, 0xc7, 0x96,
+  0x54, 0x77, 0xd0, 0x0e, 0x7d, 0xda, 0xba, 0x99, 0x97, 0xd2, 0xed, 0x18,
+  0x07, 0x11, 0xdb, 0x54, 0xb4, 0x52, 0x2c, 0x53, 0x93, 0xea, 0x83, 0x76,
+  0x89, 0x58, 0x6f, 0x0a, 0x52, 0x26, 0xee, 0x99, 0x82, 0x17, 0xa2, 0x70,
+  0xc8, 0x81, 0x90, 0xb9, 0xff, 0xc1, 0x6e, 0x7f, 0xdb, 0x65, 0x70, 0x06,
+  0xcb, 0x2f, 0xb6, 0x7c, 0x34, 0x98, 0x6b, 0x6c, 0xec, 0xe0, 0xa8, 0x4f,
+  0x58, 0xbb, 0xe3, 0xc3, 0xc9, 0x8c, 0xd2, 0x44, 0x94, 0xb5, 0x1f, 0xfb,
+  0xfc, 0x23, 0x9d, 0xf8, 0xd8, 0xc9, 0x86, 0x08, 0xef, 0x50, 0x0d, 0x30,
+  0x8a, 0x59, 0xbd, 0x8f, 0x50, 0x8f, 0xf6, 0xe3, 0xe6, 0xc5, 0x45, 0x39,
+  0xe2, 0xd1, 0xde, 0x77, 0x9c, 0xba, 0x95, 0x1e, 0x0c, 0x38, 0x8b, 0x6c,
+  0x37, 0xda, 0x55, 0x62, 0x62, 0x2f, 0x43, 0x9d, 0xe3, 0x09, 0x2f, 0x0f,
+  0xf1, 0x3a, 0x5c, 0x22, 0x63, 0xd6, 0x45, 0x77, 0x1b, 0x27, 0x13, 0x82,
+  0xc1, 0x01, 0xfa, 0xb8, 0xf3, 0x98, 0xcc, 0x98, 0x08, 0x7b, 0x83, 0x99,
+  0x4b, 0xdb, 0xc7, 0xfd, 0x8e, 0x50, 0xd9, 0x31, 0xe9, 0x6e, 0x40, 0x8a,
+  0x2f, 0x17, 0x0c, 0x1b, 0x41, 0x9a, 0x3f, 0xb5, 0x3e, 0x13, 0xde, 0x23,
+  0xf5, 0xf1, 0x45, 0x3c, 0x56, 0xa7, 0x1f, 0x4f, 0xfb, 0x3e, 0x0b, 0xde,
+  0xcb, 0xf7, 0x51, 0x91, 0x96, 0xa3, 0x3f, 0x67, 0x49, 0xa4, 0x7e, 0x8d,
+  0xd1, 0x46, 0x0e, 0x72, 0x69, 0x44, 0xef, 0xde, 0xc1, 0x09, 0x2f, 0x75,
+  0xab, 0x83, 0x91, 0xa4, 0x73, 0x43, 0x57, 0xb3, 0xd2, 0xde, 0xd0, 0x25,
+  0xcd, 0xee, 0x14, 0x61, 0x38, 0x07, 0x43, 0x0a, 0x48, 0xb4, 0x10, 0x56,
+  0xb1, 0xca, 0x36, 0x87, 0x4c, 0x95, 0x27, 0x3b, 0xe2, 0x18, 0xb4, 0xf9,
+  0xd2, 0xad, 0x5d, 0x0c, 0x06, 0x1c, 0xb7, 0xdf, 0x8c, 0x4a, 0x31, 0x84,
+  0x0f, 0x10, 0x9d, 0x3d, 0x6b, 0xab, 0x79, 0x9c, 0xef, 0xae, 0x73, 0xff,
+  0xfe, 0x20, 0x91, 0xdc, 0x50, 0x4b, 0x03, 0x04, 0x3f, 0x00, 0x02, 0x00,
+  0x0e, 0x00, 0xa4, 0xbd, 0x50, 0x5d, 0xa2, 0x90, 0x28, 0x8f, 0x18, 0x00,
+  0x00, 0x00, 0x05, 0x00, 0x00, 0x00, 0x05, 0x00, 0x00, 0x00, 0x62, 0x2e,
+  0x74, 0x78, 0x74, 0x09, 0x04, 0x05, 0x00, 0x5d, 0x00, 0x00, 0x80, 0x00,
+  0x00, 0x39, 0x9a, 0x0a, 0x44, 0x61, 0x11, 0x7f, 0x3b, 0x3f, 0xff, 0xfc,
+  0xcf, 0x50, 0x00, 0x50, 0x4b, 0x01, 0x02, 0x3f, 0x03, 0x3f, 0x00, 0x02,
+  0x00, 0x0e, 0x00, 0xa4, 0xbd, 0x50, 0x5d, 0x84, 0xfe, 0x23, 0x3b, 0x05,
+  0x03, 0x00, 0x00, 0x3a, 0x61, 0x00, 0x00, 0x05, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x80, 0x01, 0x00, 0x00, 0x00,
+  0x00, 0x61, 0x2e, 0x74, 0x78, 0x74, 0x50, 0x4b, 0x01, 0x02, 0x3f, 0x03,
+  0x3f, 0x00, 0x02, 0x00, 0x0e, 0x00, 0xa4, 0xbd, 0x50, 0x5d, 0xa2, 0x90,
+  0x28, 0x8f, 0x18, 0x00, 0x00, 0x00, 0x05, 0x00, 0x00, 0x00, 0x05, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x80, 0x01,
+  0x28, 0x03, 0x00, 0x00, 0x62, 0x2e, 0x74, 0x78, 0x74, 0x50, 0x4b, 0x05,
+  0x06, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00, 0x02, 0x00, 0x66, 0x00, 0x00,
+  0x00, 0x63, 0x03, 0x00, 0x00, 0x00, 0x00
+};
+#endif
 
 @interface TestLowlevel : XCTestCase
 
@@ -193,4 +491,561 @@
   str_release(&tmp);
 }
 
+- (void) testZipWriter {
+  // a stored file of multiple blocks containing data descriptor signatures
+  std::string stored(300*1024, 'x');
+  for (size_t i = 0; i < stored.size(); i += 1000)
+    stored.replace(i, 4, "PK\7\10");
+  std::string deflated = stored + "deflated";
+  char path[1000];
+  snprintf(path, 1000, "%s/writer.zip", NSTemporaryDirectory().UTF8String);
+  for (int nthreads = 1; nthreads <= 4; nthreads += 3) {
+    int fd = open(path, O_CREAT|O_TRUNC|O_WRONLY, 0644);
+    XCTAssert(fd >= 0);
+    zip::Writer writer(fd, nthreads);
+    writer.add("stored", stored.data(), stored.size(), 0, false);
+    writer.add("deflated", deflated.data(), deflated.size());
+    writer.add("empty", "", 0);
+    writer.finish();
+    close(fd);
+    for (int mode = 0; mode < 3; mode++) {
+      ZipCollector collector;
+      zip::Stream stream(collector);
+      if (mode == 1) stream.setThreads(2);
+      if (mode == 2) stream.setLazy(true);
+      XCTAssertNoThrow(stream.scanFile(path));
+      stream.finish();
+      XCTAssert(collector.names == "stored;deflated;empty;");
+      XCTAssert(collector.data == stored + deflated);
+    }
+  }
+  unlink(path);
+  // write errors are thrown
+  int fd = open("/dev/full", O_WRONLY);
+  if (fd >= 0) {
+    zip::Writer writer(fd, 1);
+    XCTAssertThrows(writer.add("stored", stored.data(), stored.size(), 0,
+                               false));
+    XCTAssertThrows(writer.add("deflated", deflated.data(), deflated.size()));
+    close(fd);
+  }
+}
+
+- (void) testZipExtractor {
+  // directory entries (also empty ones) as written by 'zip -r'
+  std::string path = tmpPath("dirs.zip"), dir = tmpPath("dirs");
+  int fd = open(path.c_str(), O_CREAT|O_TRUNC|O_WRONLY, 0644);
+  zip::Writer writer(fd, 1);
+  writer.add("a/", "", 0);
+  writer.add("a/b/", "", 0);
+  writer.add("a/b/file", "contents", 8);
+  writer.add("a/empty/", "", 0);
+  writer.add("c/d/file", "more", 4);
+  writer.finish();
+  close(fd);
+  removeAll(dir);
+  // the directories exist when extracting the second time
+  for (int i = 0; i < 2; i++) {
+    zip::Extractor extractor(dir.c_str());
+    zip::Stream stream(extractor);
+    XCTAssertNoThrow(stream.scanFile(path.c_str()));
+    XCTAssertNoThrow(stream.finish());
+  }
+  XCTAssert(isDirectory(dir + "/a/empty"));
+  XCTAssert(fileContents(dir + "/a/b/file") == "contents");
+  XCTAssert(fileContents(dir + "/c/d/file") == "more");
+  removeAll(dir);
+  zip::Archive archive(path.c_str());
+  XCTAssertNoThrow(archive.extractAll(dir.c_str(), 2));
+  XCTAssertNoThrow(archive.extractAll(dir.c_str(), 2));
+  XCTAssert(isDirectory(dir + "/a/empty"));
+  XCTAssert(fileContents(dir + "/a/b/file") == "contents");
+  removeAll(dir);
+  unlink(path.c_str());
+}
+
+- (void) testZipLzma {
+#if defined(ZIP_LZMA)
+  std::string a;
+  char line[100];
+  for (int i = 0; i < 1000; i++) {
+    snprintf(line, 100, "line %d of an lzma file\n", i);
+    a += line;
+  }
+  for (int mode = 0; mode < 3; mode++) {
+    ZipCollector collector;
+    zip::Stream stream(collector);
+    if (mode == 1) stream.setThreads(2);
+    if (mode == 2) stream.setLazy(true);
+    // small pieces let the buffer grow while the header is read
+    for (size_t i = 0; i < sizeof lzmaZip; i += 100) {
+      size_t len = (sizeof lzmaZip - i < 100)? sizeof lzmaZip - i : 100;
+      XCTAssertNoThrow(stream.scan((const char *) lzmaZip + i, (long) len));
+    }
+    XCTAssertNoThrow(stream.finish());
+    XCTAssert(collector.names == "a.txt;b.txt;");
+    XCTAssert(collector.data == a + "short");
+  }
+#endif
+}
+
+- (void) testZipCrc {
+  // the CRC32 of files of all lengths modulo 8 and 64
+  std::string zip, expected, names;
+  for (int len = 0; len < 300; len += (len < 140)? 1 : 37) {
+    std::string data;
+    for (int i = 0; i < len; i++) data += (char) (i * 7 + len);
+    std::string name = "f" + std::to_string(len);
+    addFile(zip, name, data);
+    expected += data;
+    names += name + ";";
+  }
+  ZipCollector collector;
+  zip::Stream stream(collector);
+  XCTAssertNoThrow(stream.scan(zip.data(), (long) zip.size()));
+  XCTAssertNoThrow(stream.finish());
+  XCTAssert(collector.names == names);
+  XCTAssert(collector.data == expected);
+  // a wrong CRC is detected
+  zip[14] ^= 1;
+  ZipCollector collector2;
+  zip::Stream stream2(collector2);
+  XCTAssertThrows(stream2.scan(zip.data(), (long) zip.size()));
+}
+
+- (void) testZipArchive {
+  std::string zip, path = tmpPath("archive.zip");
+  std::vector<ZipEntry> entries;
+  for (int i = 0; i < 100; i++) {
+    std::string name = "dir/f" + std::to_string(i);
+    entries.push_back(addFile(zip, name, name + " contents"));
+  }
+  addCentral(zip, entries);
+  writeContents(path, zip);
+  { zip::Archive archive(path.c_str());
+    XCTAssert(archive.count() == 100);
+    XCTAssert(archive.find("dir/f42") == 42);
+    XCTAssert(archive.find("dir/none") < 0);
+    zip::File *file = archive.extract("dir/f99");
+    XCTAssert(file && (std::string((const char *) file->data(), file->size())
+                       == "dir/f99 contents"));
+    delete file;
+    XCTAssert(archive.extract("dir/none") == 0);
+  }
+  // a compressed size near 2^64 (in the Zip64 extra field) is rejected
+  zip.clear();
+  entries.clear();
+  entries.push_back(addFile(zip, "huge", "0123456789", 8));
+  entries[0].csize = ~(uint64_t) 0 - 15;
+  addCentral(zip, entries);
+  writeContents(path, zip);
+  { zip::Archive archive(path.c_str());
+    XCTAssertThrows(delete archive.extract("huge")); }
+  unlink(path.c_str());
+}
+
+- (void) testZipResume {
+  std::string zip, names;
+  std::vector<ZipEntry> entries;
+  for (int i = 0; i < 20; i++) {
+    std::string name = "f" + std::to_string(i);
+    entries.push_back(addFile(zip, name, std::string(1000 + i, 'a' + i), 
+                              (i % 2)? 8 : 0, i % 3 == 0));
+    names += name + ";";
+  }
+  long end = (long) zip.size();
+  addCentral(zip, entries);
+  // interrupted in the middle of f10
+  long cut = (long) entries[10].offset + 500;
+  for (int threads = 0; threads <= 2; threads += 2) {
+    ZipCollector first, second;
+    long offset;
+    { zip::Stream stream(first);
+      if (threads) stream.setThreads(threads);
+      XCTAssertNoThrow(stream.scan(zip.data(), cut));
+      XCTAssertNoThrow(stream.finish());
+      offset = stream.resumeOffset(); }
+    XCTAssert(offset == (long) entries[10].offset);
+    zip::Stream resumed(second);
+    if (threads) resumed.setThreads(threads);
+    resumed.setOffset(offset);
+    XCTAssertNoThrow(resumed.scan(zip.data() + offset, 
+                                  (long) zip.size() - offset));
+    XCTAssertNoThrow(resumed.finish());
+    XCTAssert(first.names + second.names == names);
+    XCTAssert(resumed.resumeOffset() == end);
+  }
+}
+
+- (void) testZipChunked {
+  // stored and deflated files with and without data descriptor
+  std::string zip, names, expected;
+  for (int i = 0; i < 8; i++) {
+    std::string name = "f" + std::to_string(i);
+    std::string data(100000 + i, 'a' + i);
+    addFile(zip, name, data, (i % 2)? 8 : 0, (i / 2) % 2);
+    names += name + ";";
+    expected += data;
+  }
+  for (int mode = 0; mode < 3; mode++) {
+    ChunkCollector collector;
+    zip::Stream stream(collector);
+    if (mode == 1) stream.setThreads(2);
+    // small pieces deliver files in several chunks
+    long step = (mode == 2)? 1000 : (long) zip.size();
+    for (long i = 0; i < (long) zip.size(); i += step) 
+      XCTAssertNoThrow(stream.scan(zip.data() + i, 
+                                   std::min(step, (long) zip.size() - i)));
+    XCTAssertNoThrow(stream.finish());
+    XCTAssert(collector.names == names);
+    XCTAssert(collector.data == expected);
+    XCTAssert(collector.crcErrors == 0);
+    if (mode == 2) XCTAssert(collector.chunks > 8);
+  }
+  // a wrong CRC is passed to endFile
+  zip[14] ^= 1;
+  ChunkCollector collector;
+  zip::Stream stream(collector);
+  stream.scan(zip.data(), (long) zip.size());
+  stream.finish();
+  XCTAssert(collector.crcErrors == 1);
+}
+
+- (void) testZipPipeline {
+  // large and small files alternate, so workers finish out of order
+  std::string zip, names;
+  std::vector<std::string> sorted;
+  for (int i = 0; i < 40; i++) {
+    std::string name = "f" + std::to_string(i);
+    addFile(zip, name, std::string((i % 2)? 10 : 200000, 'a' + i % 26), 8);
+    names += name + ";";
+    sorted.push_back(name);
+  }
+  std::sort(sorted.begin(), sorted.end());
+  for (int ordered = 0; ordered < 2; ordered++) {
+    ZipCollector collector;
+    zip::Stream stream(collector);
+    stream.setThreads(4, ordered);
+    XCTAssertNoThrow(stream.scan(zip.data(), (long) zip.size()));
+    XCTAssertNoThrow(stream.finish());
+    if (ordered) XCTAssert(collector.names == names);
+    std::vector<std::string> found;
+    for (size_t pos = 0, end; 
+         (end = collector.names.find(';', pos)) != std::string::npos; 
+         pos = end + 1) 
+      found.push_back(collector.names.substr(pos, end - pos));
+    std::sort(found.begin(), found.end());
+    XCTAssert(found == sorted);
+  }
+  // errors of the delegate are thrown by the scanning thread
+  struct Failing: ZipCollector {
+    void handleFile(zip::File *file) 
+      { delete file; throw std::runtime_error("failed"); }
+  } failing;
+  zip::Stream stream(failing);
+  stream.setThreads(2);
+  bool thrown = false;
+  try { stream.scan(zip.data(), (long) zip.size()); stream.finish(); }
+  catch (std::runtime_error &) { thrown = true; }
+  XCTAssert(thrown);
+}
+
+- (void) testZipExtractAll {
+  // many files in shared nested directories, extracted by 4 threads
+  std::string zip, path = tmpPath("extract.zip"), dir = tmpPath("extract");
+  std::vector<ZipEntry> entries;
+  for (int i = 0; i < 200; i++) {
+    std::string name = "d" + std::to_string(i % 5) + "/e" + 
+      std::to_string(i % 3) + "/f" + std::to_string(i);
+    entries.push_back(addFile(zip, name, std::string(100 * i, 'a' + i % 26),
+                              (i % 2)? 8 : 0));
+  }
+  addCentral(zip, entries);
+  writeContents(path, zip);
+  removeAll(dir);
+  { zip::Archive archive(path.c_str());
+    XCTAssertNoThrow(archive.extractAll(dir.c_str(), 4)); }
+  for (int i = 0; i < 200; i++) 
+    XCTAssert(fileContents(dir + "/" + entries[i].name) == 
+              std::string(100 * i, 'a' + i % 26));
+  removeAll(dir);
+  // the error of a corrupt file is thrown by extractAll
+  zip[entries[100].offset + 30 + entries[100].name.size()] ^= 1;
+  writeContents(path, zip);
+  { zip::Archive archive(path.c_str());
+    XCTAssertThrows(archive.extractAll(dir.c_str(), 4)); }
+  removeAll(dir);
+  unlink(path.c_str());
+}
+
+- (void) testZipRejected {
+  // rejected files are skipped, also deflated ones without sizes whose
+  // data contains data descriptor signatures
+  std::string zip, names, expected, sig(10000, 'x');
+  for (size_t i = 0; i < sig.size(); i += 100) sig.replace(i, 4, "PK\7\10");
+  for (int i = 0; i < 12; i++) {
+    std::string name = ((i % 3)? "keep" : "skip") + std::to_string(i);
+    std::string data = sig + std::to_string(i);
+    addFile(zip, name, data, (i % 2)? 8 : 0, (i % 4) == 1);
+    if (i % 3) { names += name + ";"; expected += data; }
+  }
+  struct Filter: ZipCollector {
+    bool shouldAccept(zip::File *file) 
+      { return strncmp(file->name(), "skip", 4) != 0; }
+  };
+  for (int mode = 0; mode < 3; mode++) {
+    Filter filter;
+    zip::Stream stream(filter);
+    if (mode == 1) stream.setThreads(2);
+    if (mode == 2) stream.setLazy(true);
+    for (size_t i = 0; i < zip.size(); i += 999) 
+      XCTAssertNoThrow(stream.scan(zip.data() + i, 
+                                   (long) std::min((size_t) 999, 
+                                                   zip.size() - i)));
+    XCTAssertNoThrow(stream.finish());
+    XCTAssert(filter.names == names);
+    XCTAssert(filter.data == expected);
+    XCTAssert(stream.stats().entries == 12);
+    XCTAssert(stream.stats().rejected == 4);
+  }
+}
+
+- (void) testZip64 {
+  // sizes in Zip64 extra fields and Zip64 data descriptors
+  std::string zip, names, expected;
+  for (int i = 0; i < 8; i++) {
+    std::string name = "f" + std::to_string(i);
+    std::string data(5000 + i, 'a' + i);
+    addFile(zip, name, data, (i % 2)? 8 : 0, (i / 2) % 2, true);
+    names += name + ";";
+    expected += data;
+  }
+  for (int mode = 0; mode < 3; mode++) {
+    ZipCollector collector;
+    zip::Stream stream(collector);
+    if (mode == 1) stream.setThreads(2);
+    if (mode == 2) stream.setLazy(true);
+    XCTAssertNoThrow(stream.scan(zip.data(), (long) zip.size()));
+    XCTAssertNoThrow(stream.finish());
+    XCTAssert(collector.names == names);
+    XCTAssert(collector.data == expected);
+  }
+  // more than 65535 files need the Zip64 end of central directory
+  std::string path = tmpPath("zip64.zip");
+  int fd = open(path.c_str(), O_CREAT|O_TRUNC|O_WRONLY, 0644);
+  { zip::Writer writer(fd, 2);
+    for (int i = 0; i < 70000; i++) {
+      std::string name = "f" + std::to_string(i);
+      writer.add(name.c_str(), name.data(), name.size(), 0, i % 2);
+    }
+    XCTAssertNoThrow(writer.finish()); }
+  close(fd);
+  { zip::Archive archive(path.c_str());
+    XCTAssert(archive.count() == 70000);
+    XCTAssert(archive.find("f69999") == 69999);
+    zip::File *file = archive.extract("f65536");
+    XCTAssert(file && (std::string((const char *) file->data(), file->size())
+                       == "f65536"));
+    delete file; }
+  ZipCollector collector;
+  zip::Stream stream(collector);
+  XCTAssertNoThrow(stream.scanFile(path.c_str()));
+  XCTAssertNoThrow(stream.finish());
+  XCTAssert(stream.stats().entries == 70000);
+  unlink(path.c_str());
+}
+
+- (void) testZipReceiving {
+  std::string zip, names, expected;
+  std::vector<ZipEntry> entries;
+  for (int i = 0; i < 20; i++) {
+    std::string name = "f" + std::to_string(i);
+    std::string data(3000 * i, 'a' + i);
+    entries.push_back(addFile(zip, name, data, (i % 2)? 8 : 0, i % 3 == 0));
+    names += name + ";";
+    expected += data;
+  }
+  // pieces of different sizes are scanned by the receiving thread, the
+  // buffer passed may be reused when receive returns
+  for (int threads = 0; threads <= 2; threads += 2) {
+    ZipCollector collector;
+    zip::Stream stream(collector);
+    if (threads) stream.setThreads(threads);
+    stream.setReceiving(4);
+    char piece[5000];
+    for (size_t i = 0, n = 1, len; i < zip.size(); i += len, n = n * 3 % 4999) {
+      len = std::min(n, zip.size() - i);
+      memcpy(piece, zip.data() + i, len);
+      XCTAssertNoThrow(stream.receive(piece, (long) len));
+      memset(piece, 0, len);
+    }
+    XCTAssertNoThrow(stream.finish());
+    XCTAssert(collector.names == names);
+    XCTAssert(collector.data == expected);
+    XCTAssert(stream.resumeOffset() == (long) zip.size());
+  }
+  // errors of the scanning thread are thrown by receive or finish
+  zip[entries[10].offset + 14] ^= 1;
+  ZipCollector collector;
+  zip::Stream stream(collector);
+  stream.setReceiving(4);
+  bool thrown = false;
+  try { 
+    for (size_t i = 0; i < zip.size(); i += 1000) 
+      stream.receive(zip.data() + i, (long) std::min((size_t) 1000, 
+                                                     zip.size() - i));
+    stream.finish();
+  }
+  catch (zip::Exception &) { thrown = true; }
+  XCTAssert(thrown);
+}
+
+- (void) testZipQueue {
+  std::string zip, names, expected;
+  std::vector<ZipEntry> entries;
+  for (int i = 0; i < 30; i++) {
+    std::string name = "f" + std::to_string(i);
+    std::string data(1000 * i, 'a' + i % 26);
+    entries.push_back(addFile(zip, name, data, (i % 2)? 8 : 0));
+    names += name + ";";
+    expected += data;
+  }
+  // files are pulled from the Queue after each piece of data
+  for (int threads = 0; threads <= 2; threads += 2) {
+    ZipCollector collector;
+    zip::Queue queue;
+    zip::Stream stream(queue);
+    if (threads) stream.setThreads(threads);
+    for (size_t i = 0; i < zip.size(); i += 5000) {
+      XCTAssertNoThrow(stream.scan(zip.data() + i, 
+                       (long) std::min((size_t) 5000, zip.size() - i)));
+      while (zip::File *file = queue.next()) collector.handleFile(file);
+    }
+    XCTAssertNoThrow(stream.finish());
+    while (zip::File *file = queue.next()) collector.handleFile(file);
+    XCTAssert(queue.count() == 0);
+    XCTAssert(collector.names == names);
+    XCTAssert(collector.data == expected);
+  }
+#if __cplusplus >= 202002L
+  // a consumer coroutine takes the files fed by a producer coroutine
+  for (size_t len = 100; len <= 100000; len *= 10) {
+    ZipCollector collector;
+    bool failed = false;
+    zip::AsyncStream stream(4);
+    consumeZip(stream, collector, failed);
+    produceZip(stream, zip, len, failed);
+    XCTAssert(!failed);
+    XCTAssert(collector.names == names);
+    XCTAssert(collector.data == expected);
+  }
+  // errors are thrown by feed and next
+  zip[entries[20].offset + 14] ^= 1;
+  ZipCollector collector;
+  bool consumerFailed = false, producerFailed = false;
+  zip::AsyncStream stream(4);
+  consumeZip(stream, collector, consumerFailed);
+  produceZip(stream, zip, 1000, producerFailed);
+  XCTAssert(consumerFailed && producerFailed);
+  XCTAssert(collector.names.find("f19;") != std::string::npos);
+#endif
+}
+
+- (void) testZipScanFile {
+  std::string zip, names, expected, path = tmpPath("scan.zip");
+  for (int i = 0; i < 20; i++) {
+    std::string name = "f" + std::to_string(i);
+    std::string data(20000 * i, 'a' + i);
+    addFile(zip, name, data, (i % 2)? 8 : 0, i % 3 == 0);
+    names += name + ";";
+    expected += data;
+  }
+  writeContents(path, zip);
+  for (int mode = 0; mode < 4; mode++) {
+    ZipCollector collector;
+    ChunkCollector chunks;
+    zip::Stream stream(collector);
+    zip::Stream chunked(chunks);
+    if (mode == 1) stream.setThreads(2);
+    if (mode == 2) stream.setLazy(true);
+    if (mode == 3) stream.setZeroCopy(true);
+    XCTAssertNoThrow(stream.scanFile(path.c_str()));
+    XCTAssert(collector.names == names);
+    XCTAssert(collector.data == expected);
+    XCTAssertNoThrow(chunked.scanFile(path.c_str()));
+    XCTAssert(chunks.names == names);
+    XCTAssert(chunks.data == expected);
+    // the first mapping is replaced when scanning the next archive
+    collector.names.clear();
+    collector.data.clear();
+    XCTAssertNoThrow(stream.scanFile(path.c_str()));
+    XCTAssert(collector.names == names);
+  }
+  // mapped files with sizes in their header refer to their contents in 
+  // place until they are kept
+  struct Keeper: zip::StreamDelegate {
+    std::vector<zip::File *> files;
+    void handleFile(zip::File *file) { files.push_back(file); }
+  } keeper;
+  zip::Stream stream(keeper);
+  stream.setLazy(true);
+  XCTAssertNoThrow(stream.scanMapped(zip.data(), (long) zip.size()));
+  XCTAssertNoThrow(stream.finish());
+  XCTAssert(keeper.files.size() == 20);
+  std::string data;
+  for (size_t i = 0; i < keeper.files.size(); i++) {
+    zip::File *file = keeper.files[i];
+    XCTAssert(file->isView() == (i % 3 != 0));
+    file->keep(); 
+    XCTAssert(!file->isView());
+    data.append((const char *) file->data(), file->size());
+    delete file;
+  }
+  XCTAssert(data == expected);
+  // an empty archive has no files, a missing one is not readable
+  ZipCollector collector;
+  zip::Stream empty(collector);
+  writeContents(path, "");
+  XCTAssertNoThrow(empty.scanFile(path.c_str()));
+  XCTAssert(collector.names.empty());
+  unlink(path.c_str());
+  XCTAssertThrows(empty.scanFile(path.c_str()));
+}
+
+- (void) testZipReader {
+  std::string zip, names, expected, path = tmpPath("reader.zip");
+  for (int i = 0; i < 20; i++) {
+    std::string name = "f" + std::to_string(i);
+    std::string data(10000 * i + i, 'a' + i);
+    addFile(zip, name, data, (i % 2)? 8 : 0, i % 3 == 0);
+    names += name + ";";
+    expected += data;
+  }
+  writeContents(path, zip);
+  // small blocks are read ahead while the preceding ones are scanned
+  for (int mode = 0; mode < 4; mode++) {
+    ZipCollector collector;
+    zip::Reader reader(path.c_str(), (mode == 3)? 1 : 4, 
+                       (mode == 3)? 1024*1024 : 4096);
+    XCTAssert(!strcmp(reader.backend(), "threads") || 
+              !strcmp(reader.backend(), "io_uring"));
+    zip::Stream stream(collector);
+    if (mode == 1) stream.setThreads(2);
+    if (mode == 2) stream.setLazy(true);
+    XCTAssertNoThrow(reader.scan(stream));
+    XCTAssert(collector.names == names);
+    XCTAssert(collector.data == expected);
+  }
+  // the reads in flight are waited for when scanning fails
+  struct Failing: ZipCollector {
+    void handleFile(zip::File *file) 
+      { delete file; throw std::runtime_error("failed"); }
+  } failing;
+  { zip::Reader reader(path.c_str(), 8, 4096);
+    zip::Stream stream(failing);
+    XCTAssertThrows(reader.scan(stream)); }
+  unlink(path.c_str());
+  XCTAssertThrows(zip::Reader(path.c_str()));
+}
+
 @end